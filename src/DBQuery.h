@@ -5,6 +5,7 @@
 #include "Subscription.h"
 #include "filters.h"
 #include "events.h"
+#include "IndexStats.h"
 
 
 struct DBScan : NonCopyable {
@@ -14,11 +15,160 @@ struct DBScan : NonCopyable {
         uint64_t levIdStorage;
 
       public:
+        CandidateEvent() : packed(0), levIdStorage(0) {}
         CandidateEvent(uint64_t levId, uint64_t created, uint64_t scanIndex) : packed(scanIndex << 40 | created), levIdStorage(levId) {}
 
-        uint64_t levId() { return levIdStorage; }
-        uint64_t created() { return packed & 0xFF'FFFFFFFF; }
-        uint64_t scanIndex() { return packed >> 40; }
+        uint64_t levId() const { return levIdStorage; }
+        uint64_t created() const { return packed & 0xFF'FFFFFFFF; }
+        uint64_t scanIndex() const { return packed >> 40; }
+    };
+
+    // Merges the candidates collected by every cursor into one stream, ordered by (created, levId), descending unless
+    // ascending. Each cursor has a buffer for the candidates of its latest fill, and a binary heap orders the cursors by
+    // their next candidate. Taking a candidate or refilling a buffer costs O(log cursors), and never copies the other
+    // cursors' candidates.
+    //
+    // Buffers are blocks allocated from two arenas for the whole scan: one of initial-fill-sized blocks, and one of
+    // refill-sized blocks. A cursor moves to a refill-sized block on its first refill, so cursors that are never
+    // refilled (most of them, when there are many) only hold the initial depth
+
+    struct CandidateMerger {
+        static const uint32_t NO_BLOCK = ~uint32_t(0);
+
+        struct Arena {
+            uint64_t blockSize = 0;
+            std::vector<CandidateEvent> events;
+            std::vector<uint32_t> freeBlocks;
+
+            uint32_t alloc() {
+                if (freeBlocks.size()) {
+                    uint32_t block = freeBlocks.back();
+                    freeBlocks.pop_back();
+                    return block;
+                }
+
+                uint32_t block = events.size() / blockSize;
+                events.resize(events.size() + blockSize);
+                return block;
+            }
+        };
+
+        struct Buffer {
+            uint32_t block = NO_BLOCK;
+            uint32_t head = 0;
+            uint32_t size = 0;
+            uint32_t arena = 0;
+        };
+
+        bool ascending = false;
+        Arena arenas[2]; // initial-fill-sized blocks, refill-sized blocks
+        std::vector<Buffer> buffers; // by scanIndex
+        std::vector<uint32_t> heap; // scanIndexes of the buffers with candidates remaining
+
+        void init(bool ascending_, uint64_t initialBlockSize, uint64_t refillBlockSize, size_t numCursors) {
+            ascending = ascending_;
+            arenas[0].blockSize = initialBlockSize;
+            arenas[1].blockSize = std::max(refillBlockSize, initialBlockSize);
+            buffers.resize(numCursors);
+            heap.reserve(numCursors);
+        }
+
+        bool before(const CandidateEvent &a, const CandidateEvent &b) const {
+            if (ascending) return a.created() == b.created() ? a.levId() < b.levId() : a.created() < b.created();
+            return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
+        }
+
+        bool empty() const {
+            return heap.empty();
+        }
+
+        uint64_t remaining(uint64_t scanIndex) const {
+            return buffers[scanIndex].size - buffers[scanIndex].head;
+        }
+
+        // Next candidate of a buffer, which must have some remaining
+        const CandidateEvent &peek(uint64_t scanIndex) const {
+            const auto &b = buffers[scanIndex];
+            const auto &a = arenas[b.arena];
+            return a.events[b.block * a.blockSize + b.head];
+        }
+
+        // Where an empty buffer's cursor can collect up to depth candidates (at most the refill block size), followed
+        // by filled()
+        CandidateEvent *fillStart(uint64_t scanIndex, uint64_t depth) {
+            auto &b = buffers[scanIndex];
+
+            if (b.block != NO_BLOCK && depth > arenas[b.arena].blockSize) release(b);
+
+            if (b.block == NO_BLOCK) {
+                b.arena = depth > arenas[0].blockSize ? 1 : 0;
+                b.block = arenas[b.arena].alloc();
+            }
+
+            auto &a = arenas[b.arena];
+            return a.events.data() + b.block * a.blockSize;
+        }
+
+        void filled(uint64_t scanIndex, uint64_t n) {
+            auto &b = buffers[scanIndex];
+            b.head = 0;
+            b.size = n;
+
+            if (n == 0) {
+                // Cursor is finished
+                release(b);
+                return;
+            }
+
+            heap.push_back(scanIndex);
+            siftUp(heap.size() - 1);
+        }
+
+        // Removes the next candidate overall. If that empties its buffer, the buffer leaves the heap until refilled
+        CandidateEvent pop() {
+            uint32_t scanIndex = heap[0];
+            auto ev = peek(scanIndex);
+            buffers[scanIndex].head++;
+
+            if (remaining(scanIndex) == 0) {
+                heap[0] = heap.back();
+                heap.pop_back();
+            }
+
+            if (heap.size()) siftDown(0);
+
+            return ev;
+        }
+
+      private:
+        void release(Buffer &b) {
+            arenas[b.arena].freeBlocks.push_back(b.block);
+            b.block = NO_BLOCK;
+        }
+
+        bool heapBefore(size_t i, size_t j) const {
+            return before(peek(heap[i]), peek(heap[j]));
+        }
+
+        void siftUp(size_t pos) {
+            while (pos > 0) {
+                size_t parent = (pos - 1) / 2;
+                if (!heapBefore(pos, parent)) break;
+                std::swap(heap[pos], heap[parent]);
+                pos = parent;
+            }
+        }
+
+        void siftDown(size_t pos) {
+            while (1) {
+                size_t child = 2 * pos + 1;
+                if (child >= heap.size()) break;
+                if (child + 1 < heap.size() && heapBefore(child + 1, child)) child++;
+                if (!heapBefore(child, pos)) break;
+                std::swap(heap[pos], heap[child]);
+                pos = child;
+            }
+        }
     };
 
     enum class KeyMatchResult {
@@ -27,31 +177,186 @@ struct DBScan : NonCopyable {
         NoButContinue,
     };
 
+    // The (created_at, levId) pairs under one key prefix of an index, such as a single tag value or pubkey.
+    // Index keys end in created_at and the values are levIds, so these are ordered by (created_at, levId)
+
+    struct IndexStream {
+        lmdb::dbi dbi;
+        std::function<std::string(uint64_t)> makeKey; // key in this stream at a given created_at
+        std::function<std::optional<uint64_t>(std::string_view)> parseCreated; // nullopt if key is outside this stream
+
+        // Largest (created_at, levId) in the stream that is <= (created, levId), or when ascending, the smallest that is >=
+        std::optional<std::pair<uint64_t, uint64_t>> seek(lmdb::txn &txn, uint64_t created, uint64_t levId, bool ascending = false) {
+            std::optional<std::pair<uint64_t, uint64_t>> output;
+
+            env.generic_foreachFull(txn, dbi, makeKey(created), lmdb::to_sv<uint64_t>(levId), [&](auto k, auto v) {
+                auto c = parseCreated(k);
+                if (c) output = { *c, lmdb::from_sv<uint64_t>(v) };
+                return false;
+            }, !ascending);
+
+            return output;
+        }
+    };
+
+    static IndexStream tagStream(const std::string &search) {
+        return IndexStream{
+            env.dbi_Event__tag,
+            [search](uint64_t created){ return makeKey_StringUint64(search, created); },
+            [search](std::string_view k) -> std::optional<uint64_t> {
+                if (k.size() != search.size() + 8 || !k.starts_with(search)) return std::nullopt;
+                return ParsedKey_StringUint64(k).n;
+            },
+        };
+    }
+
+    static IndexStream pubkeyStream(const std::string &pubkey) {
+        return IndexStream{
+            env.dbi_Event__pubkey,
+            [pubkey](uint64_t created){ return makeKey_StringUint64(pubkey, created); },
+            [pubkey](std::string_view k) -> std::optional<uint64_t> {
+                if (k.size() != pubkey.size() + 8 || !k.starts_with(pubkey)) return std::nullopt;
+                return ParsedKey_StringUint64(k).n;
+            },
+        };
+    }
+
+    static IndexStream pubkeyKindStream(const std::string &pubkey, uint64_t kind) {
+        return IndexStream{
+            env.dbi_Event__pubkeyKind,
+            [pubkey, kind](uint64_t created){ return makeKey_StringUint64Uint64(pubkey, kind, created); },
+            [pubkey, kind](std::string_view k) -> std::optional<uint64_t> {
+                if (!k.starts_with(pubkey)) return std::nullopt;
+                ParsedKey_StringUint64Uint64 parsedKey(k);
+                if (parsedKey.s != pubkey || parsedKey.n1 != kind) return std::nullopt;
+                return parsedKey.n2;
+            },
+        };
+    }
+
+    enum class IndexPlan {
+        Id,
+        Intersect,
+        Tag,
+        PubkeyKind,
+        Pubkey,
+        Kind,
+        CreatedAt,
+    };
+
+    // Compares the first N bytes. With N known at compile time, this becomes a few word compares
+    template<size_t N>
+    static bool fixedEq(const char *a, const char *b) {
+        return memcmp(a, b, N) == 0;
+    }
+
     struct ScanCursor {
         std::string resumeKey;
         uint64_t resumeVal;
-        std::function<KeyMatchResult(std::string_view)> keyMatch;
-        uint64_t outstanding = 0; // number of records remaining in eventQueue, decremented in DBScan::scan
+        std::string keyPrefix; // keys are this followed by created_at, unless the filter has id/author prefixes
+        uint64_t kind = 0; // for PubkeyKind cursors with a pubkey prefix, where keyPrefix is only the prefix
+
+        // Kept open between collect() calls within one DBScan::scan(). While dbCursorPositioned, it's on (resumeKey, resumeVal)
+        std::optional<lmdb::cursor> dbCursor;
+        bool dbCursorPositioned = false;
+
+        // Metrics, see DBScan::explain()
+        uint64_t keysVisited = 0; // index entries read, or seeks for intersection cursors
+        uint64_t seeks = 0; // B-tree descents, as opposed to stepping to the adjacent entry
+        uint64_t collected = 0; // candidates added to the merger
+        uint64_t refills = 0; // collect() calls after the initial one
+        uint64_t timeUs = 0; // only measured when DBScan::analyze is set
+
+        // Intersection cursors only visit events present in all of the streams, and don't use resumeKey/keyPrefix
+        std::vector<IndexStream> streams;
+        uint64_t resumeCreated = 0;
+        bool intersectActive = false;
+
+        ScanCursor(std::string resumeKey, uint64_t resumeVal, std::string keyPrefix, uint64_t kind = 0) : resumeKey(std::move(resumeKey)), resumeVal(resumeVal), keyPrefix(std::move(keyPrefix)), kind(kind) {}
+        ScanCursor(std::vector<IndexStream> &&streams, uint64_t startCreated, uint64_t startLevId) : resumeVal(startLevId), streams(std::move(streams)), resumeCreated(startCreated), intersectActive(true) {}
 
         bool active() {
+            if (streams.size()) return intersectActive;
             return resumeKey.size() > 0;
         }
 
-        uint64_t collect(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, std::deque<CandidateEvent> &output) {
+        // Whether an index key belongs to this cursor. Called for every key visited, so it's specialised for each index
+
+        template<IndexPlan P>
+        KeyMatchResult keyMatch(std::string_view k) const {
+            auto result = [](bool matched){ return matched ? KeyMatchResult::Yes : KeyMatchResult::No; };
+            const char *p = keyPrefix.data();
+
+            if constexpr (P == IndexPlan::Id || P == IndexPlan::Pubkey) {
+                if (keyPrefix.size() == 32) return result(k.size() == 32 + 8 && fixedEq<32>(k.data(), p));
+                return result(k.starts_with(keyPrefix));
+            } else if constexpr (P == IndexPlan::Tag) {
+                return result(k.size() == keyPrefix.size() + 8 && memcmp(k.data(), p, keyPrefix.size()) == 0);
+            } else if constexpr (P == IndexPlan::PubkeyKind) {
+                if (keyPrefix.size() == 32 + 8) return result(k.size() == 32 + 8 + 8 && fixedEq<32 + 8>(k.data(), p));
+                if (!k.starts_with(keyPrefix)) return KeyMatchResult::No;
+
+                // With a prefix pubkey, continue scanning (pubkey,kind) because with this index
+                // we don't know the next pubkey to jump back to
+                ParsedKey_StringUint64Uint64 parsedKey(k);
+                return parsedKey.n1 == kind ? KeyMatchResult::Yes : KeyMatchResult::NoButContinue;
+            } else if constexpr (P == IndexPlan::Kind) {
+                return result(k.size() == 8 + 8 && fixedEq<8>(k.data(), p));
+            } else {
+                return KeyMatchResult::Yes;
+            }
+        }
+
+        // Appends up to limit candidates to output, returning how many
+
+        uint64_t collect(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, CandidateEvent *output) {
+            switch (s.plan) {
+                case IndexPlan::Id: return collectKeys<IndexPlan::Id>(txn, s, scanIndex, limit, output);
+                case IndexPlan::Intersect: return collectIntersection(txn, s, scanIndex, limit, output);
+                case IndexPlan::Tag: return collectKeys<IndexPlan::Tag>(txn, s, scanIndex, limit, output);
+                case IndexPlan::PubkeyKind: return collectKeys<IndexPlan::PubkeyKind>(txn, s, scanIndex, limit, output);
+                case IndexPlan::Pubkey: return collectKeys<IndexPlan::Pubkey>(txn, s, scanIndex, limit, output);
+                case IndexPlan::Kind: return collectKeys<IndexPlan::Kind>(txn, s, scanIndex, limit, output);
+                case IndexPlan::CreatedAt: return collectKeys<IndexPlan::CreatedAt>(txn, s, scanIndex, limit, output);
+            }
+
+            return 0;
+        }
+
+        template<IndexPlan P>
+        uint64_t collectKeys(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, CandidateEvent *output) {
             uint64_t added = 0;
 
             while (active() && limit > 0) {
-                bool finished = env.generic_foreachFull(txn, s.indexDbi, resumeKey, lmdb::to_sv<uint64_t>(resumeVal), [&](auto k, auto v) {
+                if (!dbCursor) dbCursor = lmdb::cursor::open(txn, s.indexDbi);
+
+                std::string_view k, v;
+                bool found;
+
+                if (dbCursorPositioned) {
+                    // Still on the entry the previous collect() stopped at, so no need to descend the B-tree
+                    found = dbCursor->get(k, v, MDB_GET_CURRENT);
+                } else {
+                    found = seekIndex(*dbCursor, resumeKey, resumeVal, k, v, !s.ascending);
+                    seeks++;
+                }
+
+                dbCursorPositioned = false;
+
+                for (; found; found = dbCursor->get(k, v, s.ascending ? MDB_NEXT : MDB_PREV)) {
                     if (limit == 0) {
                         resumeKey = std::string(k);
                         resumeVal = lmdb::from_sv<uint64_t>(v);
-                        return false;
+                        dbCursorPositioned = true;
+                        break;
                     }
 
-                    auto matched = keyMatch(k);
+                    keysVisited++;
+
+                    auto matched = keyMatch<P>(k);
                     if (matched == KeyMatchResult::No) {
                         resumeKey = "";
-                        return false;
+                        break;
                     }
 
                     uint64_t created;
@@ -60,33 +365,123 @@ struct DBScan : NonCopyable {
                         ParsedKey_StringUint64 parsedKey(k);
                         created = parsedKey.n;
 
+                        // Outside the time range: jump to its start, or past this key prefix if we've gone through it
+
                         if (s.f.since && created < s.f.since) {
-                            resumeKey = makeKey_StringUint64(parsedKey.s, 0);
+                            resumeKey = makeKey_StringUint64(parsedKey.s, s.ascending ? s.f.since : 0);
                             resumeVal = 0;
-                            return false;
+                            break;
                         }
 
                         if (s.f.until && created > s.f.until) {
-                            resumeKey = makeKey_StringUint64(parsedKey.s, s.f.until);
+                            resumeKey = makeKey_StringUint64(parsedKey.s, s.ascending ? MAX_U64 : s.f.until);
                             resumeVal = MAX_U64;
-                            return false;
+                            break;
                         }
                     }
 
                     if (matched == KeyMatchResult::Yes) {
                         uint64_t levId = lmdb::from_sv<uint64_t>(v);
-                        output.emplace_back(levId, created, scanIndex);
+                        output[added] = CandidateEvent(levId, created, scanIndex);
                         added++;
                         limit--;
                     }
+                }
 
-                    return true;
-                }, true);
+                if (!found) resumeKey = "";
+            }
+
+            collected += added;
+            return added;
+        }
+
+        // Closes dbCursor, which is only valid within the txn it was opened in
 
-                if (finished) resumeKey = "";
+        void releaseDbCursor() {
+            dbCursor.reset();
+            dbCursorPositioned = false;
+        }
+
+        // Positions cursor at the largest (key, val) <= the given one, or when not reverse, the smallest that is >=
+
+        static bool seekIndex(lmdb::cursor &cursor, std::string_view key, uint64_t val, std::string_view &k, std::string_view &v, bool reverse) {
+            k = key;
+            v = lmdb::to_sv<uint64_t>(val);
+
+            if (cursor.get(k, v, MDB_GET_BOTH_RANGE)) {
+                // On the first val >= the given one under this key
+                if (!reverse || lmdb::from_sv<uint64_t>(v) == val) return true;
+                return cursor.get(k, v, MDB_PREV);
+            }
+
+            k = key;
+
+            if (!cursor.get(k, v, MDB_SET_RANGE)) {
+                // Past the end of the DB
+                return reverse ? cursor.get(k, v, MDB_LAST) : false;
             }
 
-            outstanding += added;
+            if (k == key) {
+                // Every val under this key is smaller than the given one
+                return cursor.get(k, v, reverse ? MDB_LAST_DUP : MDB_NEXT_NODUP);
+            }
+
+            return reverse ? cursor.get(k, v, MDB_PREV) : true;
+        }
+
+        // Leapfrog join: each stream in turn seeks to the largest entry <= the current target (>= when ascending).
+        // An entry past the target becomes the new target, and once every stream has landed on the target it's a
+        // match. Index entries that can't be in the intersection are skipped over, and events are never loaded
+
+        uint64_t collectIntersection(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, CandidateEvent *output) {
+            uint64_t added = 0;
+
+            while (intersectActive && limit > 0) {
+                uint64_t created = resumeCreated;
+                uint64_t levId = resumeVal;
+                size_t agreed = 0;
+
+                for (size_t i = 0; agreed < streams.size(); i = (i + 1) % streams.size()) {
+                    auto pos = streams[i].seek(txn, created, levId, s.ascending);
+                    s.approxWork++;
+                    keysVisited++;
+                    seeks++;
+
+                    if (!pos || pos->first < s.f.since || pos->first > s.f.until) {
+                        intersectActive = false;
+                        break;
+                    }
+
+                    if (pos->first == created && pos->second == levId) {
+                        agreed++;
+                    } else {
+                        created = pos->first;
+                        levId = pos->second;
+                        agreed = 1;
+                    }
+                }
+
+                if (!intersectActive) break;
+
+                output[added] = CandidateEvent(levId, created, scanIndex);
+                added++;
+                limit--;
+
+                if (s.ascending) {
+                    resumeCreated = created;
+                    resumeVal = levId + 1;
+                } else if (levId > 0) {
+                    resumeCreated = created;
+                    resumeVal = levId - 1;
+                } else if (created > 0) {
+                    resumeCreated = created - 1;
+                    resumeVal = MAX_U64;
+                } else {
+                    intersectActive = false;
+                }
+            }
+
+            collected += added;
             return added;
         }
     };
@@ -95,17 +490,370 @@ struct DBScan : NonCopyable {
     bool indexOnly;
     lmdb::dbi indexDbi;
     const char *desc = "?";
+    IndexPlan plan;
+    char planTagName = '\0'; // for IndexPlan::Tag
+    double estimatedCost = -1; // -1 when the index stats aren't available
+    bool ascending; // oldest first, see NostrFilter::ascending
     std::vector<ScanCursor> cursors;
-    std::deque<CandidateEvent> eventQueue; // sorted descending by created
+    CandidateMerger merger;
+
+    // Filter fields checked with EventCover before loading events, see initCover()
+    bool coverKinds = false;
+    bool coverAuthors = false;
+    bool coverDecides = false; // candidates passing the cover match the filter
+    flat_hash_set<uint64_t> coverAuthorFingerprints;
     uint64_t initialScanDepth;
     uint64_t refillScanDepth;
     uint64_t nextInitIndex = 0;
     uint64_t approxWork = 0;
 
-    DBScan(const NostrFilter &f) : f(f) {
-        indexOnly = f.indexOnlyScans;
+    // Metrics, see explain()
+    bool analyze = false; // also measure time spent on each cursor
+    uint64_t eventLookups = 0; // lookupEventByLevId() calls, for candidates not covered by the index
+    uint64_t rejected = 0; // candidates that didn't match the filter
+    uint64_t coverRejected = 0; // of which rejected by EventCover, without loading the event
+    uint64_t coverAccepted = 0; // candidates accepted by EventCover, without loading the event
+    uint64_t payloadBytes = 0;
+
+    DBScan(lmdb::txn &txn, const NostrFilter &f) : f(f), ascending(f.ascending) {
+        bool resuming = false;
+
+        if (f.continuation && planUsable((IndexPlan)f.continuation->plan, f.continuation->planTagName)) {
+            plan = (IndexPlan)f.continuation->plan;
+            planTagName = f.continuation->planTagName;
+            resuming = true;
+        } else if (f.ids) {
+            plan = IndexPlan::Id;
+        } else {
+            IndexStats stats(txn);
+
+            if (stats.complete) choosePlanByCost(stats);
+            else choosePlanFixed();
+        }
+
+        initCursors();
+
+        if (f.continuation) resumeFrom(resuming ? &*f.continuation : nullptr);
+
+        initialScanDepth = initialDepth(cursors.size());
+        refillScanDepth = 10 * initialScanDepth;
+
+        merger.init(ascending, initialScanDepth, refillScanDepth, cursors.size());
+    }
+
+    // Candidates each cursor collects before the first event can be returned. With thousands of cursors (e.g. a follow
+    // feed's authors) each one collects less, since this is paid for every cursor however small the limit is
+
+    uint64_t initialDepth(uint64_t numCursors) {
+        uint64_t minDepth = numCursors > 1'000 ? 1 : 5;
+        return std::clamp(f.limit / std::max(numCursors, uint64_t(1)), minDepth, uint64_t(50));
+    }
+
+    // Used when there are no index stats
+
+    void choosePlanFixed() {
+        if (intersectionDims(nullptr).size()) {
+            plan = IndexPlan::Intersect;
+        } else if (f.tags.size()) {
+            plan = IndexPlan::Tag;
+
+            uint64_t numTags = MAX_U64;
+            for (const auto &[tn, filterSet] : f.tags) {
+                if (filterSet.size() < numTags) {
+                    numTags = filterSet.size();
+                    planTagName = tn;
+                }
+            }
+        } else if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+            plan = IndexPlan::PubkeyKind;
+        } else if (f.authors) {
+            plan = IndexPlan::Pubkey;
+        } else if (f.kinds) {
+            plan = IndexPlan::Kind;
+        } else {
+            plan = IndexPlan::CreatedAt;
+        }
+    }
+
+    // Estimates the work each candidate index would do, in the same units as approxWork, and picks the cheapest.
+    // Fields are assumed to be independent when estimating how many events match the whole filter
+
+    void choosePlanByCost(IndexStats &stats) {
+        double total = std::max(stats.total(), uint64_t(1));
+        double matches = total;
+
+        flat_hash_map<char, double> tagEntries;
+
+        for (const auto &[tagName, filterSet] : f.tags) {
+            double n = 0;
+            for (uint64_t i = 0; i < filterSet.size(); i++) n += stats.tag(tagName, filterSet.at(i));
+            tagEntries[tagName] = n;
+            matches *= std::min(n / total, 1.0);
+        }
+
+        double authorEntries = 0;
+
+        if (f.authors) {
+            for (uint64_t i = 0; i < f.authors->size(); i++) authorEntries += stats.pubkey(f.authors->at(i));
+            matches *= std::min(authorEntries / total, 1.0);
+        }
+
+        double kindEntries = 0;
+
+        if (f.kinds) {
+            for (uint64_t i = 0; i < f.kinds->size(); i++) kindEntries += stats.kind(f.kinds->at(i));
+            matches *= std::min(kindEntries / total, 1.0);
+        }
+
+        // Scans stop once limit events have been found. Events that aren't covered by the index are loaded and
+        // checked with doesMatch(), which costs about 10 units of work (see scan()), or about 1 if EventCover decides. Before that, every cursor seeks
+        // and collects its initial candidates, which is what makes one cursor per author expensive for large author
+        // lists, compared to walking the kind or created_at index and checking each event's author
+
+        auto candidateWork = [&](IndexPlan p){
+            return planCovers(p) ? 0.0 : coverDecidesPlan(p) ? 1.0 : 10.0;
+        };
+
+        auto cost = [&](double numCursors, double indexWork, double candidates, double workPerCandidate){
+            double fraction = f.limit < matches ? f.limit / matches : 1.0;
+            double setup = numCursors * (1 + std::min((double)initialDepth((uint64_t)numCursors), indexWork / numCursors));
+            return setup + fraction * (indexWork + workPerCandidate * candidates);
+        };
+
+        auto consider = [&](IndexPlan p, char tagName, double c){
+            if (estimatedCost >= 0 && c >= estimatedCost) return;
+            plan = p;
+            planTagName = tagName;
+            estimatedCost = c;
+        };
+
+        {
+            bool covered;
+            auto dims = intersectionDims(&stats, &covered);
+
+            if (dims.size()) {
+                double numCursors = 1, minEntries = total, intersected = total;
+
+                for (const auto &dim : dims) {
+                    numCursors *= dim.streams.size();
+                    minEntries = std::min(minEntries, dim.entries);
+                    intersected *= std::min(dim.entries / total, 1.0);
+                }
+
+                // Each match, or skip over a non-match, costs about one seek per stream, and the smallest dimension
+                // bounds how many times that can happen
+                double seeks = 2 * dims.size() * minEntries;
+
+                consider(IndexPlan::Intersect, '\0', cost(numCursors, seeks, intersected, covered ? 0.0 : 10.0));
+            }
+        }
+
+        for (const auto &[tagName, filterSet] : f.tags) {
+            double n = tagEntries[tagName];
+            consider(IndexPlan::Tag, tagName, cost(filterSet.size(), n, n, candidateWork(IndexPlan::Tag)));
+        }
+
+        if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+            double n = authorEntries * kindEntries / total;
+            consider(IndexPlan::PubkeyKind, '\0', cost(f.authors->size() * f.kinds->size(), n, n, candidateWork(IndexPlan::PubkeyKind)));
+        }
+
+        if (f.authors) consider(IndexPlan::Pubkey, '\0', cost(f.authors->size(), authorEntries, authorEntries, candidateWork(IndexPlan::Pubkey)));
+        if (f.kinds) consider(IndexPlan::Kind, '\0', cost(f.kinds->size(), kindEntries, kindEntries, candidateWork(IndexPlan::Kind)));
+
+        consider(IndexPlan::CreatedAt, '\0', cost(1, total, total, candidateWork(IndexPlan::CreatedAt)));
+    }
+
+    // Whether the filter has the fields needed by a plan, in case it came from a continuation token
+
+    bool planUsable(IndexPlan p, char tagName) {
+        switch (p) {
+            case IndexPlan::Id: return !!f.ids;
+            case IndexPlan::Intersect: return intersectionDims(nullptr).size() > 0;
+            case IndexPlan::Tag: return f.tags.contains(tagName);
+            case IndexPlan::PubkeyKind: return f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000;
+            case IndexPlan::Pubkey: return !!f.authors;
+            case IndexPlan::Kind: return !!f.kinds;
+            case IndexPlan::CreatedAt: return true;
+        }
+
+        return false;
+    }
+
+    // Positions every cursor where a previous scan of this filter stopped. Tokens that don't fit this filter's
+    // cursors weren't issued by this relay, and nothing is returned for them
+
+    void resumeFrom(const ScanContinuation *cont) {
+        bool valid = cont && cont->positions.size() == cursors.size();
+
+        for (size_t i = 0; i < cursors.size(); i++) {
+            auto &c = cursors[i];
+            using Type = ScanContinuation::Position::Type;
+            auto type = valid ? cont->positions[i].type : Type::Done;
+
+            if (c.streams.size()) {
+                if (type == Type::Intersect) {
+                    c.resumeCreated = cont->positions[i].created;
+                    c.resumeVal = cont->positions[i].levId;
+                } else {
+                    c.intersectActive = false;
+                }
+            } else {
+                if (type == Type::Key) {
+                    c.resumeKey = cont->positions[i].key;
+                    c.resumeVal = cont->positions[i].levId;
+                } else {
+                    c.resumeKey = "";
+                }
+            }
+        }
+    }
+
+    // Where each cursor would carry on from, counting candidates still in its merger buffer as not yet visited.
+    // nullopt if the scan has nothing left to return
+
+    std::optional<ScanContinuation> continuation() {
+        using Type = ScanContinuation::Position::Type;
+
+        ScanContinuation output;
+        output.filterHash = f.continuationHash();
+        output.plan = (uint8_t)plan;
+        output.planTagName = planTagName;
+        output.positions.resize(cursors.size());
+
+        bool more = false;
+
+        for (size_t i = 0; i < cursors.size(); i++) {
+            auto &c = cursors[i];
+            auto &p = output.positions[i];
+
+            if (merger.remaining(i)) {
+                const auto &ev = merger.peek(i);
+
+                if (c.streams.size()) {
+                    p.type = Type::Intersect;
+                    p.created = ev.created();
+                } else {
+                    p.type = Type::Key;
+                    p.key = makeKey_StringUint64(c.keyPrefix, ev.created());
+                }
+
+                p.levId = ev.levId();
+            } else if (c.active()) {
+                if (c.streams.size()) {
+                    p.type = Type::Intersect;
+                    p.created = c.resumeCreated;
+                } else {
+                    p.type = Type::Key;
+                    p.key = c.resumeKey;
+                }
+
+                p.levId = c.resumeVal;
+            } else {
+                continue;
+            }
+
+            more = true;
+        }
+
+        if (!more) return std::nullopt;
+        return output;
+    }
+
+    // Whether the plan's index checks every field of the filter, so events don't need to be loaded and matched
+
+    bool planCovers(IndexPlan p) {
+        bool hasTags = f.tags.size() > 0;
+
+        switch (p) {
+            case IndexPlan::Id: return !f.authors && !f.kinds && !hasTags;
+            case IndexPlan::Tag: return !f.ids && !f.authors && !f.kinds && f.tags.size() == 1;
+            case IndexPlan::PubkeyKind: return !f.ids && !hasTags;
+            case IndexPlan::Pubkey: return !f.ids && !f.kinds && !hasTags;
+            case IndexPlan::Kind: return !f.ids && !f.authors && !hasTags;
+            case IndexPlan::CreatedAt: return !f.ids && !f.authors && !f.kinds && !hasTags;
+            case IndexPlan::Intersect: {
+                bool covered;
+                intersectionDims(nullptr, &covered);
+                return covered;
+            }
+        }
+
+        return false;
+    }
+
+    // EventCover holds each event's kind and pubkey fingerprint. When the plan's index doesn't check the filter's kinds
+    // or authors, candidates are checked against the cover before loading the event. If those are the only fields the
+    // index doesn't check, candidates passing the cover are matches and their events are never loaded
+
+    void initCover() {
+        if (indexOnly || plan == IndexPlan::Id || plan == IndexPlan::Intersect) return;
+
+        bool indexChecksKinds = plan == IndexPlan::PubkeyKind || plan == IndexPlan::Kind;
+        bool indexChecksAuthors = plan == IndexPlan::PubkeyKind || plan == IndexPlan::Pubkey;
+
+        coverKinds = f.kinds && !indexChecksKinds;
+
+        if (f.authors && !indexChecksAuthors) {
+            coverAuthors = true;
+
+            for (uint64_t i = 0; i < f.authors->size(); i++) {
+                auto author = f.authors->at(i);
+
+                if (author.size() < 8) {
+                    // Shorter than a fingerprint
+                    coverAuthors = false;
+                    coverAuthorFingerprints.clear();
+                    break;
+                }
+
+                coverAuthorFingerprints.insert(EventCover::fingerprint(author));
+            }
+        }
+
+        coverDecides = coverDecidesPlan(plan);
+    }
+
+    // Whether kinds are the only field of the filter that a plan's index doesn't check, so EventCover can decide matches
 
-        if (f.ids) {
+    bool coverDecidesPlan(IndexPlan p) {
+        if (p == IndexPlan::Id || p == IndexPlan::Intersect) return false;
+
+        bool indexChecksKinds = p == IndexPlan::PubkeyKind || p == IndexPlan::Kind;
+        bool indexChecksAuthors = p == IndexPlan::PubkeyKind || p == IndexPlan::Pubkey;
+        size_t tagsUnchecked = f.tags.size() - (p == IndexPlan::Tag ? 1 : 0);
+
+        return f.kinds && !indexChecksKinds && !f.ids && (!f.authors || indexChecksAuthors) && tagsUnchecked == 0;
+    }
+
+    enum class CoverResult {
+        Unknown, // not checked, or the event has no cover entry
+        Match,
+        NoMatch,
+    };
+
+    CoverResult checkCover(lmdb::cursor &eventCoverCursor, uint64_t levId) {
+        if (!coverKinds && !coverAuthors) return CoverResult::Unknown;
+
+        std::string_view key = lmdb::to_sv<uint64_t>(levId), v;
+        EventCover cover;
+        if (!eventCoverCursor.get(key, v, MDB_SET_KEY) || !EventCover::parse(v, cover)) return CoverResult::Unknown;
+
+        if (coverKinds && !f.kinds->doesMatch(cover.kind)) return CoverResult::NoMatch;
+        if (coverAuthors && !coverAuthorFingerprints.contains(cover.pubkeyFingerprint)) return CoverResult::NoMatch;
+
+        return CoverResult::Match;
+    }
+
+    void initCursors() {
+        indexOnly = planCovers(plan);
+        initCover();
+
+        // Cursors start at the newest end of their key prefix, or the oldest when ascending
+        char pad = ascending ? '\x00' : '\xFF';
+        uint64_t startVal = ascending ? 0 : MAX_U64;
+
+        if (plan == IndexPlan::Id) {
             indexDbi = env.dbi_Event__id;
             desc = "ID";
 
@@ -113,29 +861,35 @@ struct DBScan : NonCopyable {
             for (uint64_t i = 0; i < f.ids->size(); i++) {
                 std::string prefix = f.ids->at(i);
 
-                cursors.emplace_back(
-                    padBytes(prefix, 32 + 8, '\xFF'),
-                    MAX_U64,
-                    [prefix](std::string_view k){
-                        return k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
+                cursors.emplace_back(padBytes(prefix, 32 + 8, pad), startVal, prefix);
             }
-        } else if (f.tags.size()) {
-            indexDbi = env.dbi_Event__tag;
-            desc = "Tag";
+        } else if (plan == IndexPlan::Intersect) {
+            desc = "Intersect";
 
-            char tagName = '\0';
-            {
-                uint64_t numTags = MAX_U64;
-                for (const auto &[tn, filterSet] : f.tags) {
-                    if (filterSet.size() < numTags) {
-                        numTags = filterSet.size();
-                        tagName = tn;
-                    }
+            auto dims = intersectionDims(nullptr);
+
+            uint64_t numCursors = 1;
+            for (const auto &dim : dims) numCursors *= dim.streams.size();
+
+            cursors.reserve(numCursors);
+            std::vector<size_t> pos(dims.size(), 0);
+
+            for (uint64_t n = 0; n < numCursors; n++) {
+                std::vector<IndexStream> streams;
+                for (size_t d = 0; d < dims.size(); d++) streams.push_back(dims[d].streams[pos[d]]);
+
+                cursors.emplace_back(std::move(streams), ascending ? f.since : f.until, startVal);
+
+                for (size_t d = 0; d < dims.size(); d++) {
+                    if (++pos[d] < dims[d].streams.size()) break;
+                    pos[d] = 0;
                 }
             }
+        } else if (plan == IndexPlan::Tag) {
+            indexDbi = env.dbi_Event__tag;
+            desc = "Tag";
 
+            char tagName = planTagName;
             const auto &filterSet = f.tags.at(tagName);
 
             cursors.reserve(filterSet.size());
@@ -144,15 +898,9 @@ struct DBScan : NonCopyable {
                 search += tagName;
                 search += filterSet.at(i);
 
-                cursors.emplace_back(
-                    search + std::string(8, '\xFF'),
-                    MAX_U64,
-                    [search](std::string_view k){
-                        return k.size() == search.size() + 8 && k.starts_with(search) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
+                cursors.emplace_back(search + std::string(8, pad), startVal, search);
             }
-        } else if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+        } else if (plan == IndexPlan::PubkeyKind) {
             indexDbi = env.dbi_Event__pubkeyKind;
             desc = "PubkeyKind";
 
@@ -164,26 +912,10 @@ struct DBScan : NonCopyable {
                     std::string prefix = f.authors->at(i);
                     if (prefix.size() == 32) prefix += lmdb::to_sv<uint64_t>(kind);
 
-                    cursors.emplace_back(
-                        padBytes(prefix, 32 + 8 + 8, '\xFF'),
-                        MAX_U64,
-                        [prefix, kind](std::string_view k){
-                            if (!k.starts_with(prefix)) return KeyMatchResult::No;
-                            if (prefix.size() == 32 + 8) return KeyMatchResult::Yes;
-
-                            ParsedKey_StringUint64Uint64 parsedKey(k);
-                            if (parsedKey.n1 == kind) return KeyMatchResult::Yes;
-
-                            // With a prefix pubkey, continue scanning (pubkey,kind) backwards because with this index
-                            // we don't know the next pubkey to jump back to
-                            return KeyMatchResult::NoButContinue;
-                        }
-                    );
+                    cursors.emplace_back(padBytes(prefix, 32 + 8 + 8, pad), startVal, prefix, kind);
                 }
             }
-        } else if (f.authors) {
-            if (f.kinds) indexOnly = false; // because of the size limit in previous test
-
+        } else if (plan == IndexPlan::Pubkey) {
             indexDbi = env.dbi_Event__pubkey;
             desc = "Pubkey";
 
@@ -191,15 +923,9 @@ struct DBScan : NonCopyable {
             for (uint64_t i = 0; i < f.authors->size(); i++) {
                 std::string prefix = f.authors->at(i);
 
-                cursors.emplace_back(
-                    padBytes(prefix, 32 + 8, '\xFF'),
-                    MAX_U64,
-                    [prefix](std::string_view k){
-                        return k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
+                cursors.emplace_back(padBytes(prefix, 32 + 8, pad), startVal, prefix);
             }
-        } else if (f.kinds) {
+        } else if (plan == IndexPlan::Kind) {
             indexDbi = env.dbi_Event__kind;
             desc = "Kind";
 
@@ -207,91 +933,215 @@ struct DBScan : NonCopyable {
             for (uint64_t i = 0; i < f.kinds->size(); i++) {
                 uint64_t kind = f.kinds->at(i);
 
-                cursors.emplace_back(
-                    std::string(lmdb::to_sv<uint64_t>(kind)) + std::string(8, '\xFF'),
-                    MAX_U64,
-                    [kind](std::string_view k){
-                        ParsedKey_Uint64Uint64 parsedKey(k);
-                        return parsedKey.n1 == kind ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
+                std::string prefix(lmdb::to_sv<uint64_t>(kind));
+                cursors.emplace_back(prefix + std::string(8, pad), startVal, prefix);
             }
         } else {
             indexDbi = env.dbi_Event__created_at;
             desc = "CreatedAt";
 
             cursors.reserve(1);
-            cursors.emplace_back(
-                std::string(8, '\xFF'),
-                MAX_U64,
-                [](std::string_view){
-                    return KeyMatchResult::Yes;
+            cursors.emplace_back(std::string(8, pad), startVal, "");
+        }
+    }
+
+    struct IntersectDim {
+        std::vector<IndexStream> streams; // an event must be in at least one stream of every dimension
+        double entries = 0;
+    };
+
+    // When a filter constrains two or more indexed fields (tags, and/or full-length authors), their indices can be
+    // scanned together with intersection cursors instead of scanning one index and checking every candidate event.
+    // There is one cursor for each combination of values, so an empty list is returned if there would be too many.
+    // If stats is supplied, each dimension's entries are estimated
+
+    std::vector<IntersectDim> intersectionDims(IndexStats *stats, bool *coveredOut = nullptr) {
+        std::vector<IntersectDim> dims;
+        bool covered = !f.ids; // every condition in the filter is checked by the streams
+
+        for (const auto &[tagName, filterSet] : f.tags) {
+            auto &dim = dims.emplace_back();
+
+            for (uint64_t i = 0; i < filterSet.size(); i++) {
+                std::string search;
+                search += tagName;
+                search += filterSet.at(i);
+                dim.streams.push_back(tagStream(search));
+                if (stats) dim.entries += stats->tag(tagName, filterSet.at(i));
+            }
+        }
+
+        bool fullAuthors = false;
+
+        if (f.authors) {
+            fullAuthors = true;
+            for (uint64_t i = 0; i < f.authors->size(); i++) {
+                if (f.authors->at(i).size() != 32) fullAuthors = false;
+            }
+        }
+
+        if (fullAuthors) {
+            auto &dim = dims.emplace_back();
+            double total = stats ? std::max(stats->total(), uint64_t(1)) : 1;
+
+            if (f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+                for (uint64_t i = 0; i < f.authors->size(); i++) {
+                    for (uint64_t j = 0; j < f.kinds->size(); j++) {
+                        dim.streams.push_back(pubkeyKindStream(f.authors->at(i), f.kinds->at(j)));
+                        if (stats) dim.entries += (double)stats->pubkey(f.authors->at(i)) * stats->kind(f.kinds->at(j)) / total;
+                    }
+                }
+            } else {
+                for (uint64_t i = 0; i < f.authors->size(); i++) {
+                    dim.streams.push_back(pubkeyStream(f.authors->at(i)));
+                    if (stats) dim.entries += stats->pubkey(f.authors->at(i));
                 }
-            );
+
+                if (f.kinds) covered = false;
+            }
+        } else if (f.authors || f.kinds) {
+            covered = false;
         }
 
-        initialScanDepth = std::clamp(f.limit / cursors.size(), uint64_t(5), uint64_t(50));
-        refillScanDepth = 10 * initialScanDepth;
+        if (coveredOut) *coveredOut = covered;
+
+        uint64_t numCursors = 1;
+        for (const auto &dim : dims) numCursors *= dim.streams.size();
+
+        if (dims.size() < 2 || numCursors > 1'000) dims.clear();
+
+        return dims;
     }
 
     bool scan(lmdb::txn &txn, std::function<bool(uint64_t, std::string_view)> handleEvent, std::function<bool(uint64_t)> doPause) {
-        auto cmp = [](auto &a, auto &b){
-            return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
-        };
-
         auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+        auto eventCoverCursor = lmdb::cursor::open(txn, env.dbi_EventCover);
+
+        // The scan may be resumed in a different txn
+        struct ReleaseDbCursors {
+            DBScan &s;
+            ~ReleaseDbCursors() { for (auto &c : s.cursors) c.releaseDbCursor(); }
+        } releaseDbCursors{*this};
 
         while (1) {
             approxWork++;
             if (doPause(approxWork)) return false;
 
             if (nextInitIndex < cursors.size()) {
-                approxWork += cursors[nextInitIndex].collect(txn, *this, nextInitIndex, initialScanDepth, eventQueue);
+                uint64_t startTime = analyze ? hoytech::curr_time_us() : 0;
+                approxWork += fill(txn, nextInitIndex, initialScanDepth);
+                if (analyze) cursors[nextInitIndex].timeUs += hoytech::curr_time_us() - startTime;
                 nextInitIndex++;
-
-                if (nextInitIndex == cursors.size()) {
-                    std::sort(eventQueue.begin(), eventQueue.end(), cmp);
-                }
-
                 continue;
-            } else if (eventQueue.size() == 0) {
+            } else if (merger.empty()) {
                 return true;
             }
 
-            auto ev = eventQueue.front();
-            eventQueue.pop_front();
+            uint64_t startTime = analyze ? hoytech::curr_time_us() : 0;
+            auto ev = merger.pop();
+            auto &cursor = cursors[ev.scanIndex()];
             bool doSend = false;
             uint64_t levId = ev.levId();
             std::string_view eventPayload;
 
             auto loadEventPayload = [&]{
                 std::string_view key = lmdb::to_sv<uint64_t>(levId);
-                return eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY); // If not found, was deleted while scan was paused
+                bool found = eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY); // If not found, was deleted while scan was paused
+                if (found) payloadBytes += eventPayload.size();
+                return found;
             };
 
             if (indexOnly) {
                 if (f.doesMatchTimes(ev.created())) doSend = true;
                 if (!loadEventPayload()) doSend = false;
-            } else if (loadEventPayload()) {
-                approxWork += 10;
-                if (f.doesMatch(lookupEventByLevId(txn, levId).flat_nested())) doSend = true;
+            } else {
+                auto cover = checkCover(eventCoverCursor, levId);
+
+                if (cover == CoverResult::NoMatch) {
+                    approxWork++;
+                    coverRejected++;
+                } else if (cover == CoverResult::Match && coverDecides) {
+                    approxWork++;
+                    coverAccepted++;
+                    if (f.doesMatchTimes(ev.created())) doSend = true;
+                    if (!loadEventPayload()) doSend = false;
+                } else if (loadEventPayload()) {
+                    approxWork += 10;
+                    eventLookups++;
+                    if (f.doesMatch(lookupEventByLevId(txn, levId).flat_nested())) doSend = true;
+                }
             }
 
             if (doSend) {
-                if (handleEvent(levId, eventPayload)) return true;
+                if (handleEvent(levId, eventPayload)) {
+                    if (analyze) cursor.timeUs += hoytech::curr_time_us() - startTime;
+                    return true;
+                }
+            } else {
+                rejected++;
+            }
+
+            if (merger.remaining(ev.scanIndex()) == 0) {
+                cursor.refills++;
+                approxWork += fill(txn, ev.scanIndex(), refillScanDepth);
             }
 
-            cursors[ev.scanIndex()].outstanding--;
+            if (analyze) cursor.timeUs += hoytech::curr_time_us() - startTime;
+        }
+    }
 
-            if (cursors[ev.scanIndex()].outstanding == 0) {
-                std::deque<CandidateEvent> moreEvents;
-                std::deque<CandidateEvent> newEventQueue;
-                approxWork += cursors[ev.scanIndex()].collect(txn, *this, ev.scanIndex(), refillScanDepth, moreEvents);
+    // Collects more candidates from a cursor whose merger buffer is empty
 
-                std::merge(eventQueue.begin(), eventQueue.end(), moreEvents.begin(), moreEvents.end(), std::back_inserter(newEventQueue), cmp);
-                eventQueue.swap(newEventQueue);
-            }
+    uint64_t fill(lmdb::txn &txn, uint64_t scanIndex, uint64_t depth) {
+        uint64_t added = cursors[scanIndex].collect(txn, *this, scanIndex, depth, merger.fillStart(scanIndex, depth));
+        merger.filled(scanIndex, added);
+        return added;
+    }
+
+    // The chosen plan, and with analyze, what the scan did. Counters accumulate over the whole scan
+
+    tao::json::value explain() {
+        tao::json::value output = tao::json::value({
+            { "index", desc },
+            { "indexOnly", indexOnly },
+            { "coverDecides", coverDecides },
+            { "order", ascending ? "ascending" : "descending" },
+            { "estimatedCost", estimatedCost >= 0 ? tao::json::value(estimatedCost) : tao::json::null },
+            { "cursors", cursors.size() },
+            { "initialScanDepth", initialScanDepth },
+            { "refillScanDepth", refillScanDepth },
+        });
+
+        if (!analyze) return output;
+
+        uint64_t keysVisited = 0;
+        uint64_t seeks = 0;
+        auto perCursor = tao::json::empty_array;
+
+        for (const auto &c : cursors) {
+            keysVisited += c.keysVisited;
+            seeks += c.seeks;
+
+            perCursor.push_back(tao::json::value({
+                { "keysVisited", c.keysVisited },
+                { "seeks", c.seeks },
+                { "collected", c.collected },
+                { "refills", c.refills },
+                { "timeUs", c.timeUs },
+            }));
         }
+
+        output["keysVisited"] = keysVisited;
+        output["seeks"] = seeks;
+        output["rejected"] = rejected;
+        output["coverRejected"] = coverRejected;
+        output["coverAccepted"] = coverAccepted;
+        output["eventLookups"] = eventLookups;
+        output["payloadBytes"] = payloadBytes;
+        output["approxWork"] = approxWork;
+        output["perCursor"] = std::move(perCursor);
+
+        return output;
     }
 };
 
@@ -302,6 +1152,13 @@ struct DBQuery : NonCopyable {
     std::unique_ptr<DBScan> scanner;
     size_t filterGroupIndex = 0;
     bool dead = false; // external flag
+
+    // Other subscriptions with identical filters that are being fed by this query's scan. Managed by QueryScheduler
+    std::vector<std::unique_ptr<Subscription>> followers;
+    bool subRemoved = false; // sub was closed, but the scan continues for the followers
+    std::string shareKey; // non-empty while new subscriptions can join
+    size_t priorityClass = 1; // FairQueryQueue::Normal, managed by QueryScheduler
+    std::vector<uint64_t> sentInOrder; // recorded while shareKey is set (so that joining subscriptions can catch up), or if QueryScheduler::recordSent
     flat_hash_set<uint64_t> sentEventsFull;
     flat_hash_set<uint64_t> sentEventsCurr;
     uint64_t lastWorkChecked = 0;
@@ -310,6 +1167,31 @@ struct DBQuery : NonCopyable {
     uint64_t currScanSaveRestores = 0;
     uint64_t totalTime = 0;
     uint64_t totalWork = 0;
+    uint64_t totalSaveRestores = 0;
+
+    // One for each filter scanned so far, for the slow query log
+    struct ScanSummary {
+        const char *index;
+        uint64_t cursors;
+        uint64_t timeUs;
+        uint64_t work;
+        uint64_t saveRestores;
+        uint64_t recsFound;
+        uint64_t keysVisited;
+        uint64_t seeks;
+        uint64_t rejected;
+        uint64_t eventLookups;
+        uint64_t payloadBytes;
+    };
+
+    std::vector<ScanSummary> scanSummaries;
+
+    // One for each filter scanned so far: hex token to continue its scan, for filters with NostrFilter::wantsContinuation.
+    // nullopt if the filter didn't ask for one, or its scan reached the end
+    std::vector<std::optional<std::string>> continuations;
+
+    bool analyze = false; // passed to each DBScan, see DBScan::explain()
+    std::function<void(DBScan &)> onScanComplete; // called with each filter's scanner once it completes
 
     DBQuery(Subscription &sub) : sub(std::move(sub)) {}
     DBQuery(const tao::json::value &filter, uint64_t maxLimit = MAX_U64) : sub(Subscription(1, ".", NostrFilterGroup::unwrapped(filter, maxLimit))) {}
@@ -319,7 +1201,10 @@ struct DBQuery : NonCopyable {
         while (filterGroupIndex < sub.filterGroup.size()) {
             const auto &f = sub.filterGroup.filters[filterGroupIndex];
 
-            if (!scanner) scanner = std::make_unique<DBScan>(f);
+            if (!scanner) {
+                scanner = std::make_unique<DBScan>(txn, f);
+                scanner->analyze = analyze;
+            }
 
             uint64_t startTime = hoytech::curr_time_us();
 
@@ -353,18 +1238,51 @@ struct DBQuery : NonCopyable {
 
             totalTime += currScanTime;
             totalWork += scanner->approxWork;
+            totalSaveRestores += currScanSaveRestores;
+
+            {
+                uint64_t keysVisited = 0, seeks = 0;
+                for (const auto &c : scanner->cursors) {
+                    keysVisited += c.keysVisited;
+                    seeks += c.seeks;
+                }
+
+                scanSummaries.emplace_back(ScanSummary{
+                    scanner->desc, scanner->cursors.size(), currScanTime, scanner->approxWork, currScanSaveRestores, sentEventsCurr.size(),
+                    keysVisited, seeks, scanner->rejected, scanner->eventLookups, scanner->payloadBytes,
+                });
+            }
 
             if (logMetrics) {
                 LI << "[" << sub.connId << "] REQ='" << sub.subId.sv() << "'"
                    << " scan=" << scanner->desc
+                   << " estCost=" << (int64_t)scanner->estimatedCost
                    << " indexOnly=" << scanner->indexOnly
+                   << " cursors=" << scanner->cursors.size()
                    << " time=" << currScanTime << "us"
                    << " saveRestores=" << currScanSaveRestores
                    << " recsFound=" << sentEventsCurr.size()
+                   << " seeks=" << scanSummaries.back().seeks
+                   << " rejected=" << scanner->rejected
+                   << " lookups=" << scanner->eventLookups
+                   << " payloadBytes=" << scanner->payloadBytes
                    << " work=" << scanner->approxWork;
                 ;
             }
 
+            if (onScanComplete) onScanComplete(*scanner);
+
+            {
+                std::optional<std::string> token;
+
+                if (f.wantsContinuation) {
+                    auto cont = scanner->continuation();
+                    if (cont) token = to_hex(cont->encode());
+                }
+
+                continuations.emplace_back(std::move(token));
+            }
+
             scanner.reset();
             filterGroupIndex++;
             sentEventsCurr.clear();
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string.h>
+
+#include "golpe.h"
+
+#include "events.h"
+#include "Sha256Multi.h"
+#include "SigBatchVerifier.h"
+
+
+// Completes the checks of events that were deferred by parseAndVerifyEvent()
+//
+// The ids of all events are hashed together with sha256Multi(). Events with a correct id then
+// have their signatures checked by a SigBatchVerifier, which verifies them as a batch when
+// sigVerifier.useBatch is set, and one at a time otherwise.
+
+struct EventBatchVerifier : NonCopyable {
+    struct Item {
+        DeferredEventChecks checks;
+        std::string id;
+        std::string pubkey;
+        std::string error; // after verify(): empty if event is valid
+    };
+
+    std::vector<Item> items;
+    SigBatchVerifier sigVerifier;
+
+    void add(DeferredEventChecks checks, std::string_view id, std::string_view pubkey) {
+        items.emplace_back(Item{ std::move(checks), std::string(id), std::string(pubkey), "" });
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    void clear() {
+        items.clear();
+        sigVerifier.clear();
+    }
+
+    void verify(secp256k1_context *ctx) {
+        preimages.clear();
+        for (auto &item : items) preimages.emplace_back(item.checks.hashPreimage);
+
+        hashes.resize(items.size() * 32);
+        sha256Multi(preimages.data(), preimages.size(), hashes.data());
+
+        sigVerifier.clear();
+        sigIndices.clear();
+
+        for (size_t i = 0; i < items.size(); i++) {
+            auto &item = items[i];
+
+            if (item.id.size() != 32 || memcmp(hashes.data() + i * 32, item.id.data(), 32) != 0) {
+                item.error = "bad event id";
+                continue;
+            }
+
+            sigIndices.push_back(i);
+            sigVerifier.add(std::move(item.checks.sig), item.id, item.pubkey);
+        }
+
+        sigVerifier.verify(ctx);
+
+        for (size_t i = 0; i < sigIndices.size(); i++) {
+            items[sigIndices[i]].error = std::move(sigVerifier.items[i].error);
+        }
+    }
+
+  private:
+    std::vector<std::string_view> preimages;
+    std::vector<unsigned char> hashes;
+    std::vector<size_t> sigIndices;
+};
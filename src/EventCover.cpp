@@ -0,0 +1,12 @@
+#include "golpe.h"
+
+#include "EventCover.h"
+
+
+void EventCover::put(lmdb::txn &txn, uint64_t levId, const NostrIndex::Event *flat, unsigned int flags) {
+    std::string v;
+    v += lmdb::to_sv<uint64_t>(flat->kind());
+    v += lmdb::to_sv<uint64_t>(fingerprint(sv(flat->pubkey())));
+
+    env.dbi_EventCover.put(txn, lmdb::to_sv<uint64_t>(levId), v, flags);
+}
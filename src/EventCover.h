@@ -0,0 +1,35 @@
+#pragma once
+
+#include "golpe.h"
+
+
+// Covering values for scans that aren't index-only: the fields filters most often combine with an indexed field,
+// stored as a small fixed-size record per event. DBScan checks these before loading the Event record, so that a
+// filter like {"#e":[X],"kinds":[7]} scanned on the tag index can reject other kinds, and accept kind 7, without
+// the random read of the full event. Kept up to date by writeEvents() and deleteEvent(), in the EventCover table.
+//
+// Keys are levIds (native uint64). Vals are the kind (native uint64) followed by the first 8 bytes of the pubkey.
+//
+// Events written by earlier versions have no entry, and are checked by loading the event as before, until
+// `strfry stats --rebuild` fills them in.
+
+struct EventCover {
+    uint64_t kind;
+    uint64_t pubkeyFingerprint;
+
+    static uint64_t fingerprint(std::string_view pubkey) {
+        uint64_t output;
+        memcpy(&output, pubkey.data(), sizeof(output));
+        return output;
+    }
+
+    static void put(lmdb::txn &txn, uint64_t levId, const NostrIndex::Event *flat, unsigned int flags = 0);
+
+    // Parses an EventCover value, false if it's malformed
+    static bool parse(std::string_view v, EventCover &output) {
+        if (v.size() != 16) return false;
+        memcpy(&output.kind, v.data(), 8);
+        memcpy(&output.pubkeyFingerprint, v.data() + 8, 8);
+        return true;
+    }
+};
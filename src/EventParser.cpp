@@ -0,0 +1,482 @@
+#include "EventParser.h"
+
+
+static const char *hexDigits = "0123456789abcdef";
+
+static inline bool isPlainChar(uint8_t c) {
+    return c >= 0x20 && c != '"' && c != '\\' && c < 0x7F;
+}
+
+static inline void appendUtf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// Same escaping rules as tao::json::internal::escape()
+
+static inline void appendEncodedCodepoint(std::string &out, uint32_t cp) {
+    if (cp == '"') {
+        out += "\\\"";
+    } else if (cp == '\\') {
+        out += "\\\\";
+    } else if (cp < 0x20) {
+        switch (cp) {
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hexDigits[(cp & 0xF0) >> 4];
+                out += hexDigits[cp & 0x0F];
+        }
+    } else if (cp == 0x7F) {
+        out += "\\u007f";
+    } else {
+        appendUtf8(out, cp);
+    }
+}
+
+static inline void appendUint(std::string &out, uint64_t n) {
+    char buf[24];
+    char *e = buf + sizeof(buf);
+    char *s = e;
+
+    do {
+        *--s = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+
+    out.append(s, e - s);
+}
+
+// Returns length of a valid multi-byte UTF-8 sequence at p, or 0 if invalid (overlongs and surrogates rejected)
+
+static inline size_t utf8SeqLen(const char *p, const char *end) {
+    auto b = [&](size_t i){ return (uint8_t)p[i]; };
+    auto cont = [&](size_t i){ return (b(i) & 0xC0) == 0x80; };
+    size_t avail = end - p;
+    uint8_t c = b(0);
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        if (avail < 2 || !cont(1)) return 0;
+        return 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        if (avail < 3 || !cont(1) || !cont(2)) return 0;
+        if (c == 0xE0 && b(1) < 0xA0) return 0;
+        if (c == 0xED && b(1) > 0x9F) return 0;
+        return 3;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        if (avail < 4 || !cont(1) || !cont(2) || !cont(3)) return 0;
+        if (c == 0xF0 && b(1) < 0x90) return 0;
+        if (c == 0xF4 && b(1) > 0x8F) return 0;
+        return 4;
+    }
+
+    return 0;
+}
+
+
+
+void EventParser::parse(std::string_view json) {
+    p = json.data();
+    end = p + json.size();
+
+    id.clear();
+    pubkey.clear();
+    sig.clear();
+    tags.clear();
+    tagStrings.clear();
+    idJson.clear();
+    pubkeyJson.clear();
+    sigJson.clear();
+    contentJson.clear();
+    tagsJson.clear();
+    unknownKeys.clear();
+
+    enum : uint64_t {
+        SeenId = 1,
+        SeenPubkey = 2,
+        SeenCreatedAt = 4,
+        SeenKind = 8,
+        SeenTags = 16,
+        SeenContent = 32,
+        SeenSig = 64,
+        SeenAll = 127,
+    };
+
+    uint64_t seen = 0;
+
+    auto mark = [&](uint64_t field){
+        if (seen & field) fail(); // duplicate key
+        seen |= field;
+    };
+
+    skipWs();
+    expect('{');
+    skipWs();
+
+    if (peek('}')) {
+        p++;
+    } else {
+        while (1) {
+            keyBuf.clear();
+            parseString(&keyBuf, nullptr);
+            skipWs();
+            expect(':');
+            skipWs();
+
+            if (keyBuf == "id") {
+                mark(SeenId);
+                parseString(&id, &idJson);
+            } else if (keyBuf == "pubkey") {
+                mark(SeenPubkey);
+                parseString(&pubkey, &pubkeyJson);
+            } else if (keyBuf == "created_at") {
+                mark(SeenCreatedAt);
+                created_at = parseUnsigned();
+            } else if (keyBuf == "kind") {
+                mark(SeenKind);
+                kind = parseUnsigned();
+            } else if (keyBuf == "tags") {
+                mark(SeenTags);
+                parseTags();
+            } else if (keyBuf == "content") {
+                mark(SeenContent);
+                parseString(nullptr, &contentJson);
+            } else if (keyBuf == "sig") {
+                mark(SeenSig);
+                parseString(&sig, &sigJson);
+            } else {
+                for (const auto &k : unknownKeys) {
+                    if (k == keyBuf) fail();
+                }
+
+                unknownKeys.emplace_back(keyBuf);
+                skipValue(0);
+            }
+
+            skipWs();
+
+            if (peek(',')) {
+                p++;
+                skipWs();
+                continue;
+            }
+
+            expect('}');
+            break;
+        }
+    }
+
+    skipWs();
+    if (p != end) fail();
+
+    if (seen != SeenAll) fail();
+}
+
+
+void EventParser::parseString(std::string *decoded, std::string *encoded) {
+    expect('"');
+    if (encoded) *encoded += '"';
+
+    while (1) {
+        const char *start = p;
+        while (p != end && isPlainChar((uint8_t)*p)) p++;
+
+        if (p != start) {
+            if (decoded) decoded->append(start, p - start);
+            if (encoded) encoded->append(start, p - start);
+        }
+
+        if (p == end) fail();
+
+        uint8_t c = (uint8_t)*p;
+
+        if (c == '"') {
+            p++;
+            if (encoded) *encoded += '"';
+            break;
+        } else if (c == '\\') {
+            p++;
+            uint32_t cp = parseEscape();
+            if (decoded) appendUtf8(*decoded, cp);
+            if (encoded) appendEncodedCodepoint(*encoded, cp);
+        } else if (c == 0x7F) {
+            p++;
+            if (decoded) *decoded += (char)c;
+            if (encoded) *encoded += "\\u007f";
+        } else if (c >= 0x80) {
+            size_t len = utf8SeqLen(p, end);
+            if (len == 0) fail();
+            if (decoded) decoded->append(p, len);
+            if (encoded) encoded->append(p, len);
+            p += len;
+        } else {
+            fail(); // unescaped control character
+        }
+    }
+}
+
+uint32_t EventParser::parseEscape() {
+    if (p == end) fail();
+    char c = *p++;
+
+    switch (c) {
+        case '"': return '"';
+        case '\\': return '\\';
+        case '/': return '/';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'u': break;
+        default: fail();
+    }
+
+    auto parseHex4 = [&]{
+        if (end - p < 4) fail();
+        uint32_t v = 0;
+
+        for (size_t i = 0; i < 4; i++) {
+            char h = *p++;
+            v <<= 4;
+            if (h >= '0' && h <= '9') v |= h - '0';
+            else if (h >= 'a' && h <= 'f') v |= h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F') v |= h - 'A' + 10;
+            else fail();
+        }
+
+        return v;
+    };
+
+    uint32_t cp = parseHex4();
+
+    if (cp >= 0xD800 && cp <= 0xDBFF) {
+        if (end - p < 2 || p[0] != '\\' || p[1] != 'u') fail();
+        p += 2;
+        uint32_t low = parseHex4();
+        if (low < 0xDC00 || low > 0xDFFF) fail();
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+    } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+        fail(); // unpaired low surrogate
+    }
+
+    return cp;
+}
+
+uint64_t EventParser::parseUnsigned() {
+    if (p == end || *p < '0' || *p > '9') fail(); // negative numbers are signed in tao::json
+    if (*p == '0' && p + 1 != end && p[1] >= '0' && p[1] <= '9') fail();
+
+    uint64_t v = 0;
+
+    while (p != end && *p >= '0' && *p <= '9') {
+        uint64_t digit = *p - '0';
+        if (v > (MAX_U64 - digit) / 10) fail(); // would be parsed as a double
+        v = v * 10 + digit;
+        p++;
+    }
+
+    if (p != end && (*p == '.' || *p == 'e' || *p == 'E')) fail();
+
+    return v;
+}
+
+void EventParser::parseTags() {
+    expect('[');
+    skipWs();
+    tagsJson += '[';
+
+    if (peek(']')) {
+        p++;
+        tagsJson += ']';
+        return;
+    }
+
+    while (1) {
+        expect('[');
+        skipWs();
+        tagsJson += '[';
+
+        Tag tag{};
+
+        if (peek(']')) {
+            p++;
+        } else {
+            while (1) {
+                if (tag.numFields) tagsJson += ',';
+
+                uint32_t offset = tagStrings.size();
+                parseString(tag.numFields < 2 ? &tagStrings : nullptr, &tagsJson);
+                uint32_t size = tagStrings.size() - offset;
+
+                if (tag.numFields == 0) {
+                    tag.nameOffset = offset;
+                    tag.nameSize = size;
+                } else if (tag.numFields == 1) {
+                    tag.valOffset = offset;
+                    tag.valSize = size;
+                }
+
+                tag.numFields++;
+                skipWs();
+
+                if (peek(',')) {
+                    p++;
+                    skipWs();
+                    continue;
+                }
+
+                expect(']');
+                break;
+            }
+        }
+
+        tagsJson += ']';
+        tags.push_back(tag);
+        skipWs();
+
+        if (peek(',')) {
+            p++;
+            skipWs();
+            tagsJson += ',';
+            continue;
+        }
+
+        expect(']');
+        break;
+    }
+
+    tagsJson += ']';
+}
+
+void EventParser::skipValue(uint64_t depth) {
+    if (depth > 64) fail();
+    if (p == end) fail();
+
+    auto literal = [&](std::string_view lit){
+        if ((size_t)(end - p) < lit.size() || std::string_view(p, lit.size()) != lit) fail();
+        p += lit.size();
+    };
+
+    char c = *p;
+
+    if (c == '"') {
+        scratch.clear();
+        parseString(&scratch, nullptr);
+    } else if (c == '[') {
+        p++;
+        skipWs();
+
+        if (peek(']')) {
+            p++;
+            return;
+        }
+
+        while (1) {
+            skipValue(depth + 1);
+            skipWs();
+
+            if (peek(',')) {
+                p++;
+                skipWs();
+                continue;
+            }
+
+            expect(']');
+            break;
+        }
+    } else if (c == 't') {
+        literal("true");
+    } else if (c == 'f') {
+        literal("false");
+    } else if (c == 'n') {
+        literal("null");
+    } else if (c == '-') {
+        p++;
+        parseUnsigned();
+    } else {
+        // Objects are not handled since tao::json rejects duplicate keys at any depth
+        parseUnsigned();
+    }
+}
+
+
+
+void EventParser::canonicalJson(std::string &out) const {
+    out.clear();
+    out.reserve(128 + contentJson.size() + idJson.size() + pubkeyJson.size() + sigJson.size() + tagsJson.size());
+
+    out += "{\"content\":";
+    out += contentJson;
+    out += ",\"created_at\":";
+    appendUint(out, created_at);
+    out += ",\"id\":";
+    out += idJson;
+    out += ",\"kind\":";
+    appendUint(out, kind);
+    out += ",\"pubkey\":";
+    out += pubkeyJson;
+    out += ",\"sig\":";
+    out += sigJson;
+    out += ",\"tags\":";
+    out += tagsJson;
+    out += "}";
+}
+
+std::string_view EventParser::hashPreimage() {
+    preimageBuf.clear();
+
+    preimageBuf += "[0,";
+    preimageBuf += pubkeyJson;
+    preimageBuf += ',';
+    appendUint(preimageBuf, created_at);
+    preimageBuf += ',';
+    appendUint(preimageBuf, kind);
+    preimageBuf += ',';
+    preimageBuf += tagsJson;
+    preimageBuf += ',';
+    preimageBuf += contentJson;
+    preimageBuf += ']';
+
+    return preimageBuf;
+}
+
+bool EventParser::unwrapEventMessage(std::string_view msg, std::string_view &eventJson) {
+    auto isWs = [](char c){ return c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+
+    size_t i = 0, j = msg.size();
+
+    while (i < j && isWs(msg[i])) i++;
+    if (i == j || msg[i] != '[') return false;
+    i++;
+    while (i < j && isWs(msg[i])) i++;
+    if (!msg.substr(i).starts_with("\"EVENT\"")) return false;
+    i += 7;
+    while (i < j && isWs(msg[i])) i++;
+    if (i == j || msg[i] != ',') return false;
+    i++;
+
+    while (j > i && isWs(msg[j - 1])) j--;
+    if (j == i || msg[j - 1] != ']') return false;
+    j--;
+
+    eventJson = msg.substr(i, j - i);
+    return true;
+}
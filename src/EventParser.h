@@ -0,0 +1,103 @@
+#pragma once
+
+#include "golpe.h"
+
+
+// Single-pass parser for nostr event JSON
+//
+// Reads the raw text once and extracts everything that would otherwise need a tao::json DOM:
+// the indexed fields used to build the flatbuffer, the canonical (sorted-key) JSON that is
+// stored in EventPayload, and the NIP-01 hash preimage. Output is byte-for-byte identical to
+// what tao::json::to_string() would produce for the same event.
+//
+// Only the common case is handled. Anything unusual (non-string tag items, floats, objects in
+// unknown fields, duplicate keys, etc) makes tryParse() return false, and the caller should
+// fall back to parsing a DOM and using the tao::json based functions in events.h.
+//
+// Buffers are kept across calls, so a parser should be re-used by a thread.
+
+struct EventParser {
+    struct Tag {
+        uint32_t nameOffset;
+        uint32_t nameSize;
+        uint32_t valOffset;
+        uint32_t valSize;
+        uint32_t numFields;
+    };
+
+    // Decoded fields
+
+    std::string id; // hex
+    std::string pubkey; // hex
+    std::string sig; // hex
+    uint64_t created_at = 0;
+    uint64_t kind = 0;
+    std::vector<Tag> tags;
+    std::string tagStrings; // decoded tag names and values, referenced by Tag offsets
+
+    // JSON-encoded fields, as tao::json would output them
+
+    std::string idJson;
+    std::string pubkeyJson;
+    std::string sigJson;
+    std::string contentJson;
+    std::string tagsJson;
+
+    bool tryParse(std::string_view json) {
+        try {
+            parse(json);
+        } catch (std::exception &) {
+            return false;
+        }
+
+        return true;
+    }
+
+    void parse(std::string_view json);
+
+    std::string_view tagName(const Tag &t) const {
+        return std::string_view(tagStrings).substr(t.nameOffset, t.nameSize);
+    }
+
+    std::string_view tagVal(const Tag &t) const {
+        return std::string_view(tagStrings).substr(t.valOffset, t.valSize);
+    }
+
+    void canonicalJson(std::string &out) const;
+    std::string_view hashPreimage();
+
+    // Locates the event object inside a ["EVENT", {...}] client message. Returns false if the
+    // message isn't in this simple form (it may still be valid, in which case use the DOM path)
+    static bool unwrapEventMessage(std::string_view msg, std::string_view &eventJson);
+
+  private:
+    const char *p = nullptr;
+    const char *end = nullptr;
+    std::string keyBuf;
+    std::string scratch;
+    std::string preimageBuf;
+    std::vector<std::string> unknownKeys;
+
+    [[noreturn]] void fail() {
+        throw herr("unsupported event JSON");
+    }
+
+    bool peek(char c) {
+        return p != end && *p == c;
+    }
+
+    void expect(char c) {
+        if (!peek(c)) fail();
+        p++;
+    }
+
+    void skipWs() {
+        while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    }
+
+    void parseString(std::string *decoded, std::string *encoded);
+    uint32_t parseEscape();
+    uint64_t parseUnsigned();
+    void parseTags();
+    void skipValue(uint64_t depth);
+};
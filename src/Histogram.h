@@ -0,0 +1,61 @@
+#pragma once
+
+#include <math.h>
+
+#include <array>
+#include <atomic>
+#include <bit>
+
+#include "golpe.h"
+
+
+// Histogram with power-of-2 buckets, updated and read from different threads without locking
+//
+// Bucket i counts values v where std::bit_width(v) == i, so bucket 0 counts zeros. Percentiles are
+// reported as the upper bound of the bucket they fall in, so they are accurate to within a factor of 2.
+
+struct Log2Histogram {
+    std::array<std::atomic<uint64_t>, 65> buckets{};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+
+    void add(uint64_t v) {
+        buckets[std::bit_width(v)]++;
+        count++;
+        sum += v;
+
+        uint64_t prevMax = max;
+        while (v > prevMax && !max.compare_exchange_weak(prevMax, v)) {}
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t total = count;
+        if (total == 0) return 0;
+
+        uint64_t target = std::max((uint64_t)::ceil(total * p), (uint64_t)1);
+        uint64_t cumulative = 0;
+
+        for (size_t i = 0; i < buckets.size(); i++) {
+            cumulative += buckets[i];
+            if (cumulative >= target) {
+                uint64_t upper = i == 0 ? 0 : i >= 64 ? MAX_U64 : (1ULL << i) - 1;
+                return std::min(upper, max.load());
+            }
+        }
+
+        return max;
+    }
+
+    std::string render() const {
+        uint64_t n = count;
+        if (n == 0) return "n=0";
+
+        return std::string("n=") + std::to_string(n)
+            + " avg=" + std::to_string(sum / n)
+            + " p50<=" + std::to_string(percentile(0.5))
+            + " p90<=" + std::to_string(percentile(0.9))
+            + " p99<=" + std::to_string(percentile(0.99))
+            + " max=" + std::to_string(max);
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <mutex>
+
+#include "golpe.h"
+
+
+// Ids of events that have been verified and queued for the writer, but not yet written.
+// Shared between all ingester threads and the writer thread, so it is internally locked.
+// Sharded on the first byte of the id to keep lock contention low.
+//
+// Connections that send an event again while it is in flight are recorded against its id, and
+// the writer sends them the same OK as the original once its result is known.
+
+struct InFlightEvents : NonCopyable {
+    static const size_t NUM_SHARDS = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        flat_hash_map<std::string, std::vector<uint64_t>> ids; // id -> connIds of duplicates waiting for its OK
+    };
+
+    Shard shards[NUM_SHARDS];
+
+    // Returns false if the id was already present, in which case connId is added to its waiting duplicates
+    bool insert(std::string_view id, uint64_t connId) {
+        auto &shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        auto res = shard.ids.try_emplace(std::string(id));
+        if (!res.second) res.first->second.push_back(connId);
+        return res.second;
+    }
+
+    // Returns false if the id isn't present
+    bool addDuplicate(std::string_view id, uint64_t connId) {
+        auto &shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        auto it = shard.ids.find(id);
+        if (it == shard.ids.end()) return false;
+        it->second.push_back(connId);
+        return true;
+    }
+
+    // Returns the connIds of the duplicates that were waiting for its OK
+    std::vector<uint64_t> erase(std::string_view id) {
+        auto &shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        std::vector<uint64_t> waiting;
+
+        auto it = shard.ids.find(id);
+        if (it == shard.ids.end()) return waiting;
+        std::swap(waiting, it->second);
+        shard.ids.erase(it);
+
+        return waiting;
+    }
+
+  private:
+    Shard &getShard(std::string_view id) {
+        return shards[id.size() ? (uint8_t)id[0] % NUM_SHARDS : 0];
+    }
+};
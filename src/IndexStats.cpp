@@ -0,0 +1,110 @@
+#include <cmath>
+
+#include "golpe.h"
+
+#include "IndexStats.h"
+
+
+static const size_t BUCKET_BYTES = 3;
+
+
+static std::string bucketOf(std::string_view s) {
+    // FNV-1a: tag values are arbitrary strings, and the bucketing must be stable on disk
+    uint32_t h = 2166136261;
+
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 16777619;
+    }
+
+    return std::string((const char *)&h, BUCKET_BYTES);
+}
+
+
+IndexStats::IndexStats(lmdb::txn &txn) : txn(txn) {
+    std::string_view v;
+    complete = env.dbi_IndexStats.get(txn, completeKey(), v);
+}
+
+uint64_t IndexStats::get(std::string_view key) {
+    std::string_view v;
+    if (!env.dbi_IndexStats.get(txn, key, v)) return 0;
+    return lmdb::from_sv<uint64_t>(v);
+}
+
+uint64_t IndexStats::total() {
+    return get(totalKey());
+}
+
+uint64_t IndexStats::kind(uint64_t kind) {
+    return get(kindKey(kind));
+}
+
+uint64_t IndexStats::pubkey(std::string_view prefix) {
+    if (prefix.size() < BUCKET_BYTES) return total() / (uint64_t)std::pow(256, prefix.size());
+    return get(pubkeyKey(prefix));
+}
+
+uint64_t IndexStats::tag(char tagName, std::string_view tagVal) {
+    return get(tagKey(tagName, tagVal));
+}
+
+
+std::string IndexStats::totalKey() {
+    return "N";
+}
+
+std::string IndexStats::completeKey() {
+    return "C";
+}
+
+std::string IndexStats::kindKey(uint64_t kind) {
+    return std::string("K") + std::string(lmdb::to_sv<uint64_t>(kind));
+}
+
+std::string IndexStats::pubkeyKey(std::string_view pubkey) {
+    return std::string("P") + std::string(pubkey.substr(0, BUCKET_BYTES));
+}
+
+std::string IndexStats::tagKey(char tagName, std::string_view tagVal) {
+    return std::string("T") + tagName + bucketOf(tagVal);
+}
+
+
+void IndexStats::markComplete(lmdb::txn &txn) {
+    env.dbi_IndexStats.put(txn, completeKey(), lmdb::to_sv<uint64_t>(1));
+}
+
+void IndexStats::clear(lmdb::txn &txn) {
+    env.dbi_IndexStats.drop(txn);
+}
+
+
+void IndexStatsDelta::add(const NostrIndex::Event *flat, int64_t delta) {
+    deltas[IndexStats::totalKey()] += delta;
+    deltas[IndexStats::kindKey(flat->kind())] += delta;
+    deltas[IndexStats::pubkeyKey(sv(flat->pubkey()))] += delta;
+
+    for (const auto &tagPair : *(flat->tagsGeneral())) {
+        deltas[IndexStats::tagKey((char)tagPair->key(), sv(tagPair->val()))] += delta;
+    }
+
+    for (const auto &tagPair : *(flat->tagsFixed32())) {
+        deltas[IndexStats::tagKey((char)tagPair->key(), sv(tagPair->val()))] += delta;
+    }
+}
+
+void IndexStatsDelta::apply(lmdb::txn &txn) {
+    for (const auto &[key, delta] : deltas) {
+        if (delta == 0) continue;
+
+        std::string_view v;
+        int64_t count = env.dbi_IndexStats.get(txn, key, v) ? (int64_t)lmdb::from_sv<uint64_t>(v) : 0;
+        count += delta;
+
+        if (count <= 0) env.dbi_IndexStats.del(txn, key);
+        else env.dbi_IndexStats.put(txn, key, lmdb::to_sv<uint64_t>((uint64_t)count));
+    }
+
+    deltas.clear();
+}
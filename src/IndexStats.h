@@ -0,0 +1,52 @@
+#pragma once
+
+#include "golpe.h"
+
+
+// Approximate event counts, used by DBScan to estimate how many index entries a scan will visit.
+// Kept up to date by writeEvents() and deleteEvent(), and stored in the IndexStats table.
+//
+// Keys are a type byte followed by:
+//   'N': nothing. Total number of events
+//   'K': kind (native uint64)
+//   'P': first 3 bytes of the pubkey. Pubkeys are uniformly distributed, so this serves as a hash bucket
+//   'T': tag name, then a 3 byte hash bucket of the tag value
+//   'C': nothing. Present when the counts cover every event in the DB
+// Vals are native uint64 counts. Since pubkeys and tag values are bucketed, their counts are overestimates.
+//
+// DBs created before these stats existed have no 'C' entry, and DBScan falls back to a fixed index order
+// until they're built with `strfry stats --rebuild`.
+
+struct IndexStats {
+    lmdb::txn &txn;
+    bool complete;
+
+    IndexStats(lmdb::txn &txn);
+
+    uint64_t total();
+    uint64_t kind(uint64_t kind);
+    uint64_t pubkey(std::string_view prefix); // prefixes shorter than a bucket are estimated from the total
+    uint64_t tag(char tagName, std::string_view tagVal);
+
+    static std::string totalKey();
+    static std::string completeKey();
+    static std::string kindKey(uint64_t kind);
+    static std::string pubkeyKey(std::string_view pubkey);
+    static std::string tagKey(char tagName, std::string_view tagVal);
+
+    static void markComplete(lmdb::txn &txn);
+    static void clear(lmdb::txn &txn); // also clears the complete flag, see `strfry stats --rebuild`
+
+  private:
+    uint64_t get(std::string_view key);
+};
+
+
+// Count changes accumulated over many events, so each stats key is only written once per txn
+
+struct IndexStatsDelta {
+    flat_hash_map<std::string, int64_t> deltas;
+
+    void add(const NostrIndex::Event *flat, int64_t delta);
+    void apply(lmdb::txn &txn);
+};
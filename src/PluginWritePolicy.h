@@ -53,14 +53,30 @@ struct PluginWritePolicy {
 
     std::unique_ptr<RunningPlugin> running; 
 
-    WritePolicyResult acceptEvent(const tao::json::value &evJson, uint64_t receivedAt, EventSourceType sourceType, std::string_view sourceInfo, std::string &okMsg) {
-        const auto &pluginPath = cfg().relay__writePolicy__plugin;
+    // Returns false if no plugin is configured, in which case every event is accepted
 
-        if (pluginPath.size() == 0) {
+    bool active() {
+        if (cfg().relay__writePolicy__plugin.size() == 0) {
             running.reset();
-            return WritePolicyResult::Accept;
+            return false;
         }
 
+        return true;
+    }
+
+    WritePolicyResult acceptEvent(const tao::json::value &evJson, uint64_t receivedAt, EventSourceType sourceType, std::string_view sourceInfo, std::string &okMsg) {
+        if (!active()) return WritePolicyResult::Accept;
+
+        return acceptEventJson(tao::json::to_string(evJson), evJson.at("id").get_string(), receivedAt, sourceType, sourceInfo, okMsg);
+    }
+
+    // Same as above, but eventJson is already serialised (for example, the normalised JSON created by an ingester)
+
+    WritePolicyResult acceptEventJson(std::string_view eventJson, std::string_view idHex, uint64_t receivedAt, EventSourceType sourceType, std::string_view sourceInfo, std::string &okMsg) {
+        if (!active()) return WritePolicyResult::Accept;
+
+        const auto &pluginPath = cfg().relay__writePolicy__plugin;
+
         try {
             if (running) {
                 if (pluginPath != running->currPluginPath || cfg().relay__writePolicy__lookbackSeconds != running->lookbackSeconds) {
@@ -79,15 +95,19 @@ struct PluginWritePolicy {
                 sendLookbackEvents();
             }
 
+            // Keys are output in sorted order, so "event" can be spliced in at the start
+
             auto request = tao::json::value({
                 { "type", "new" },
-                { "event", evJson },
                 { "receivedAt", receivedAt / 1000000 },
                 { "sourceType", eventSourceTypeToStr(sourceType) },
                 { "sourceInfo", sourceType == EventSourceType::IP4 || sourceType == EventSourceType::IP6 ? renderIP(sourceInfo) : sourceInfo },
             });
 
-            std::string output = tao::json::to_string(request);
+            std::string output = "{\"event\":";
+            output += eventJson;
+            output += ",";
+            output += std::string_view(tao::json::to_string(request)).substr(1);
             output += "\n";
 
             if (::fwrite(output.data(), 1, output.size(), running->w) != output.size()) throw herr("error writing to plugin");
@@ -105,7 +125,7 @@ struct PluginWritePolicy {
                     continue;
                 }
 
-                if (response.at("id").get_string() != request.at("event").at("id").get_string()) throw herr("id mismatch");
+                if (response.at("id").get_string() != idHex) throw herr("id mismatch");
 
                 break;
             }
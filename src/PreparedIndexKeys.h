@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Index keys and lookup keys for an event, computed before it reaches the writer
+//
+// Ingester threads call prepareIndexKeys() (see events.h) and attach the result to the event, so the
+// single writer thread doesn't have to build them. writeEvents() uses the probe keys for its duplicate,
+// deletion and replacement checks, and points current at the keys while calling insert_Event(), where
+// the Event indexPrelude in golpe.yaml moves them into place instead of computing them.
+//
+// Keys in the multi-value indices are sorted, so they are inserted in order.
+
+struct PreparedIndexKeys {
+    std::string eventId; // raw 32 bytes, identifies which event these keys belong to
+
+    // Index keys, as built by the Event indexPrelude
+    std::string id;
+    std::string pubkey;
+    std::string kind;
+    std::string pubkeyKind;
+    std::vector<std::string> tag;
+    std::vector<std::string> deletion;
+    std::vector<std::string> replace;
+
+    // Probe keys for writeEvents()
+    std::string deletionProbe; // eventId + pubkey, looked up in the deletion index
+    std::optional<std::string> replaceSearch; // pubkey + d-tag, for replaceable events
+    std::vector<std::string> deletionTargets; // event ids referenced by e tags of a kind 5 event
+
+    static inline thread_local PreparedIndexKeys *current = nullptr;
+
+    static PreparedIndexKeys *forEvent(std::string_view eventId) {
+        return current && current->eventId == eventId ? current : nullptr;
+    }
+};
@@ -1,17 +1,138 @@
 #pragma once
 
+#include <array>
+
 #include "DBQuery.h"
 
 
+// Deficit round robin over flows identified by Key. Flow must have an int64_t deficit, which is charged for the
+// work done on the flow's behalf. The flow at the front of the order has the turn until its deficit runs out,
+// and then it gets another quantum and goes to the back.
+
+template<typename Key, typename Flow>
+struct DrrFlows {
+    flat_hash_map<Key, Flow> flows;
+    std::deque<Key> order;
+
+    bool empty() const {
+        return order.empty();
+    }
+
+    // Flows that weren't active go to the front with a full quantum, so that new work is started promptly
+    Flow &activate(const Key &key, int64_t quantum) {
+        auto res = flows.try_emplace(key);
+
+        if (res.second) {
+            res.first->second.deficit = quantum;
+            order.push_front(key);
+        }
+
+        return res.first->second;
+    }
+
+    // Key of the flow whose turn it is, which will then be at the front of order
+    Key next(int64_t quantum) {
+        while (1) {
+            auto &flow = flows.at(order.front());
+            if (flow.deficit > 0) return order.front();
+
+            flow.deficit += quantum;
+
+            Key key = std::move(order.front());
+            order.pop_front();
+            order.push_back(std::move(key));
+        }
+    }
+
+    Flow &get(const Key &key) {
+        return flows.at(key);
+    }
+
+    void removeFront() {
+        flows.erase(order.front());
+        order.pop_front();
+    }
+};
+
+
+// Queries waiting for a timeslice. Within a priority class, IPs take turns, and within an IP, connections take turns,
+// so a client gets the same share of the ReqWorker however many subscriptions or connections it opens. Each turn is
+// worth one timeslice budget of scan time. A connection's own queries are run round robin, newest first.
+// Priority classes are strict: lower classes only run when the higher ones are empty.
+
+struct FairQueryQueue {
+    enum Priority : size_t {
+        High, // id lookups
+        Normal,
+        Low, // demoted after using a lot of scan time
+        NumPriorities,
+    };
+
+    struct ConnFlow {
+        int64_t deficit = 0;
+        std::deque<DBQuery*> queries;
+    };
+
+    struct IpFlow {
+        int64_t deficit = 0;
+        DrrFlows<uint64_t, ConnFlow> conns;
+    };
+
+    std::array<DrrFlows<std::string, IpFlow>, NumPriorities> classes;
+    size_t size = 0;
+
+    bool empty() const {
+        return size == 0;
+    }
+
+    void push(DBQuery *q, bool isNew, int64_t quantum) {
+        size++;
+
+        auto &ip = classes[q->priorityClass].activate(q->sub.ipAddr, quantum);
+        auto &conn = ip.conns.activate(q->sub.connId, quantum);
+
+        if (isNew) conn.queries.push_front(q);
+        else conn.queries.push_back(q);
+    }
+};
+
+
 struct QueryScheduler : NonCopyable {
     std::function<void(lmdb::txn &txn, const Subscription &sub, uint64_t levId, std::string_view eventPayload)> onEvent;
     std::function<void(lmdb::txn &txn, const Subscription &sub, const std::vector<uint64_t> &levIds)> onEventBatch;
     std::function<void(Subscription &sub)> onComplete;
+    std::function<void(DBQuery &query)> onQueryComplete; // called before onComplete, while the DBQuery's metrics are available
+    std::function<void(const Subscription &sub, DBQuery &query)> onShared; // sub joined query's scan instead of starting its own
+
+    // When enabled, a subscription whose normalised filters match a query that is still scanning joins it rather
+    // than starting a new scan. It is sent the events the scan has produced so far, and then receives the rest as
+    // they are found. Its latestEventId is lowered to the query's, so the events written in between are sent after
+    // EOSE by the ReqMonitor. maxShareLevIdLag bounds how many such events there can be.
+    bool shareScans = false;
+    uint64_t maxShareLevIdLag = 0;
+
+    bool recordSent = false; // keep every query's sentInOrder until it completes, for onQueryComplete
+
+    // Queries are scheduled by FairQueryQueue. Id lookups can be given high priority, and queries that have used more
+    // than demoteAfterMicroseconds of scan time (if non-zero) only run when no other queries are waiting
+    bool prioritiseIdLookups = false;
+    uint64_t demoteAfterMicroseconds = 0;
+
+    uint64_t timesliceBudgetMicroseconds = 0; // 0 to use relay.queryTimesliceBudgetMicroseconds
+
+    // Called when a query's timeslice ends and other queries are waiting. It can hand the query to another thread
+    // (returning true), which should call processTimeslice() once and then pass the query back to returnQuery() on
+    // this thread. Until then the query belongs to the other thread: it isn't shared, and subscriptions removed in
+    // the meantime are flagged as removed straight away (so the other thread stops sending to them), but are only
+    // detached once it's returned
+    std::function<bool(DBQuery *q)> onPaused;
 
     using ConnQueries = flat_hash_map<SubId, DBQuery*>;
     flat_hash_map<uint64_t, ConnQueries> conns; // connId -> subId -> DBQuery*
-    std::deque<DBQuery*> running;
+    flat_hash_map<std::string, DBQuery*> shareable; // DBQuery::shareKey -> DBQuery*
+    FairQueryQueue running;
     std::vector<uint64_t> levIdBatch;
+    flat_hash_map<DBQuery*, std::vector<ConnIdSubId>> away; // queries handed off by onPaused -> subscriptions removed since
 
     bool addSub(lmdb::txn &txn, Subscription &&sub) {
         sub.latestEventId = getMostRecentLevId(txn);
@@ -28,10 +149,30 @@ struct QueryScheduler : NonCopyable {
             return false;
         }
 
+        std::string shareKey;
+
+        if (shareScans) {
+            shareKey = tao::json::to_string(sub.filterGroup.toJson());
+
+            auto f = shareable.find(shareKey);
+            if (f != shareable.end() && !away.contains(f->second) && sub.latestEventId - f->second->sub.latestEventId <= maxShareLevIdLag) {
+                joinQuery(txn, f->second, std::move(sub));
+                return true;
+            }
+        }
+
         DBQuery *q = new DBQuery(sub);
 
+        if (prioritiseIdLookups && q->sub.filterGroup.isIdLookup()) q->priorityClass = FairQueryQueue::High;
+
         connQueries.try_emplace(q->sub.subId, q);
-        running.push_front(q);
+        running.push(q, true, quantum());
+
+        if (shareKey.size()) {
+            // Replaces any query with the same filters that was too far behind to join
+            shareable[shareKey] = q;
+            q->shareKey = std::move(shareKey);
+        }
 
         return true;
     }
@@ -49,16 +190,15 @@ struct QueryScheduler : NonCopyable {
     void removeSub(uint64_t connId, const SubId &subId) {
         auto *query = findQuery(connId, subId);
         if (!query) return;
-        query->dead = true;
-        conns[connId].erase(subId);
-        if (conns[connId].empty()) conns.erase(connId);
+        detach(query, connId, subId);
+        eraseConnEntry(connId, subId);
     }
 
     void closeConn(uint64_t connId) {
         auto f1 = conns.find(connId);
         if (f1 == conns.end()) return;
 
-        for (auto &[k, v] : f1->second) v->dead = true;
+        for (auto &[subId, q] : f1->second) detach(q, connId, subId);
 
         conns.erase(connId);
     }
@@ -66,33 +206,177 @@ struct QueryScheduler : NonCopyable {
     void process(lmdb::txn &txn) {
         if (running.empty()) return;
 
-        DBQuery *q = running.front();
-        running.pop_front();
+        auto *cls = &running.classes[0];
+        while (cls->empty()) cls++;
 
-        if (q->dead) {
-            delete q;
-            return;
+        auto &ip = cls->get(cls->next(quantum()));
+        auto &conn = ip.conns.get(ip.conns.next(quantum()));
+
+        DBQuery *q = conn.queries.front();
+        conn.queries.pop_front();
+        running.size--;
+
+        if (q->dead) delete q;
+        else processQuery(txn, q, ip, conn);
+
+        if (conn.queries.empty()) {
+            ip.conns.removeFront();
+            if (ip.conns.empty()) cls->removeFront();
         }
+    }
+
+    // Runs one timeslice of q and sends the events found to its subscriptions. If the scan is complete, returns true
+    bool processTimeslice(lmdb::txn &txn, DBQuery *q) {
+        bool complete = q->process(txn, [&](const auto &, uint64_t levId, std::string_view eventPayload){
+            if (q->shareKey.size() || recordSent) q->sentInOrder.push_back(levId);
+
+            if (onEvent) {
+                foreachSub(q, [&](const Subscription &sub){ onEvent(txn, sub, levId, eventPayload); });
+            }
 
-        bool complete = q->process(txn, [&](const auto &sub, uint64_t levId, std::string_view eventPayload){
-            if (onEvent) onEvent(txn, sub, levId, eventPayload);
             if (onEventBatch) levIdBatch.push_back(levId);
-        }, cfg().relay__queryTimesliceBudgetMicroseconds, cfg().relay__logging__dbScanPerf);
+        }, timesliceBudget(), cfg().relay__logging__dbScanPerf);
 
         if (onEventBatch) {
-            onEventBatch(txn, q->sub, levIdBatch);
+            foreachSub(q, [&](const Subscription &sub){ onEventBatch(txn, sub, levIdBatch); });
             levIdBatch.clear();
         }
 
+        return complete;
+    }
+
+    void returnQuery(DBQuery *q, bool complete) {
+        auto f = away.find(q);
+        auto removed = std::move(f->second);
+        away.erase(f);
+
+        for (const auto &r : removed) detach(q, r.connId, r.subId);
+
+        if (q->dead) delete q;
+        else if (complete) finish(q);
+        else running.push(q, false, quantum());
+    }
+
+  private:
+    void processQuery(lmdb::txn &txn, DBQuery *q, FairQueryQueue::IpFlow &ip, FairQueryQueue::ConnFlow &conn) {
+        uint64_t startTime = hoytech::curr_time_us();
+
+        bool complete = processTimeslice(txn, q);
+
+        int64_t cost = std::max<int64_t>(1, hoytech::curr_time_us() - startTime);
+        ip.deficit -= cost;
+        conn.deficit -= cost;
+
         if (complete) {
-            auto connId = q->sub.connId;
-            removeSub(connId, q->sub.subId);
+            finish(q);
+        } else if (demoteAfterMicroseconds && q->priorityClass == FairQueryQueue::Normal && q->totalTime + q->currScanTime > demoteAfterMicroseconds) {
+            q->priorityClass = FairQueryQueue::Low;
+            running.push(q, false, quantum());
+        } else if (onPaused && !running.empty()) {
+            away.try_emplace(q);
+
+            if (!onPaused(q)) {
+                away.erase(q);
+                running.size++;
+                conn.queries.push_back(q);
+            }
+        } else {
+            running.size++;
+            conn.queries.push_back(q);
+        }
+    }
+
+    void finish(DBQuery *q) {
+        unshare(q);
+
+        foreachSub(q, [&](const Subscription &sub){ eraseConnEntry(sub.connId, sub.subId); });
+
+        if (onQueryComplete) onQueryComplete(*q);
+        if (onComplete) foreachSub(q, [&](Subscription &sub){ onComplete(sub); });
+
+        delete q;
+    }
+
+    uint64_t timesliceBudget() const {
+        return timesliceBudgetMicroseconds ? timesliceBudgetMicroseconds : cfg().relay__queryTimesliceBudgetMicroseconds;
+    }
+
+    int64_t quantum() const {
+        return std::max<int64_t>(1, timesliceBudget());
+    }
+
+    // Subscriptions that haven't been removed. May be called by another thread while q is away
+    template<typename F>
+    static void foreachSub(DBQuery *q, F &&cb) {
+        if (!q->sub.removed) cb(q->sub);
+
+        for (auto &f : q->followers) {
+            if (!f->removed) cb(*f);
+        }
+    }
 
-            if (onComplete) onComplete(q->sub);
+    void joinQuery(lmdb::txn &txn, DBQuery *q, Subscription &&sub) {
+        sub.latestEventId = q->sub.latestEventId;
 
-            delete q;
+        // Catch up on what the scan has already sent. Events deleted since then are skipped
+        for (auto levId : q->sentInOrder) {
+            if (!onEvent) break;
+
+            std::string_view eventPayload;
+            if (env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(levId), eventPayload)) onEvent(txn, sub, levId, eventPayload);
+        }
+
+        if (onEventBatch && q->sentInOrder.size()) onEventBatch(txn, sub, q->sentInOrder);
+
+        conns[sub.connId].try_emplace(sub.subId, q);
+        q->followers.emplace_back(std::make_unique<Subscription>(std::move(sub)));
+
+        if (onShared) onShared(*q->followers.back(), *q);
+    }
+
+    void detach(DBQuery *q, uint64_t connId, const SubId &subId) {
+        if (q->sub.connId == connId && q->sub.subId == subId) q->sub.removed = true;
+
+        for (auto &f : q->followers) {
+            if (f->connId == connId && f->subId == subId) f->removed = true;
+        }
+
+        if (auto f = away.find(q); f != away.end()) {
+            f->second.push_back(ConnIdSubId{ connId, subId });
+            return;
+        }
+
+        if (!q->subRemoved && q->sub.connId == connId && q->sub.subId == subId) {
+            q->subRemoved = true;
         } else {
-            running.push_back(q);
+            std::erase_if(q->followers, [&](const auto &f){ return f->connId == connId && f->subId == subId; });
         }
+
+        if (q->subRemoved && q->followers.empty()) {
+            q->dead = true;
+            unshare(q);
+        }
+    }
+
+    void unshare(DBQuery *q) {
+        if (q->shareKey.empty()) return;
+
+        auto f = shareable.find(q->shareKey);
+        if (f != shareable.end() && f->second == q) shareable.erase(f);
+
+        q->shareKey.clear();
+
+        if (!recordSent) {
+            q->sentInOrder.clear();
+            q->sentInOrder.shrink_to_fit();
+        }
+    }
+
+    void eraseConnEntry(uint64_t connId, const SubId &subId) {
+        auto f1 = conns.find(connId);
+        if (f1 == conns.end()) return;
+
+        f1->second.erase(subId);
+        if (f1->second.empty()) conns.erase(f1);
     }
 };
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <mutex>
+#include <list>
+#include <atomic>
+
+#include "golpe.h"
+
+#include "filters.h"
+#include "events.h"
+
+
+// Results of completed REQ scans, shared by all ReqWorker threads. Keyed by the normalised filter group JSON, each
+// entry holds the levIds in the order they were sent, and the latestEventId the scan ran up to (its watermark).
+//
+// An entry is only a valid answer for a REQ whose own latestEventId is later if none of the events written in
+// between match the filters. The ReqWorker checks this, and then either extends the entry's watermark or erases it.
+// It also erases entries that reference events which have since been deleted. Least recently used entries are
+// evicted to stay within maxEntries/maxBytes.
+//
+// REQs that want continuation tokens aren't cached, and neither are id lookups, which cost about as much to scan as
+// to check against the cache.
+
+struct ReqResultCache : NonCopyable {
+    struct Entry {
+        std::string key;
+        std::vector<uint64_t> levIds;
+        uint64_t latestEventId;
+
+        size_t bytes() const {
+            return sizeof(Entry) + key.size() + levIds.size() * sizeof(uint64_t);
+        }
+    };
+
+    std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    flat_hash_map<std::string_view, std::list<Entry>::iterator> entries; // keys point into lru
+    size_t currBytes = 0;
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> extensions = 0; // hits that required checking events written since the watermark
+    std::atomic<uint64_t> invalidations = 0;
+    std::atomic<uint64_t> numEntries = 0;
+    std::atomic<uint64_t> numBytes = 0;
+
+    static bool cacheable(const NostrFilterGroup &filterGroup) {
+        return !filterGroup.wantsContinuation() && !filterGroup.isIdLookup();
+    }
+
+    // If results for the filter group (normalised as key) are cached and still valid as of txn, returns their payloads
+    // and the latestEventId they're now valid up to. Entries found to be invalid are erased
+    bool lookup(lmdb::txn &txn, const std::string &key, const NostrFilterGroup &filterGroup, uint64_t maxLevIdLag,
+                std::vector<std::string_view> &eventPayloads, uint64_t &latestEventId) {
+        std::vector<uint64_t> levIds;
+        uint64_t cachedLatestEventId;
+
+        if (!get(key, levIds, cachedLatestEventId)) {
+            misses++;
+            return false;
+        }
+
+        latestEventId = getMostRecentLevId(txn);
+
+        if (cachedLatestEventId > latestEventId) {
+            // Cached by a thread with a newer txn
+            misses++;
+            return false;
+        }
+
+        if (latestEventId > cachedLatestEventId) {
+            // Still valid if nothing written since matches
+            bool valid = latestEventId - cachedLatestEventId <= maxLevIdLag;
+
+            if (valid) {
+                env.foreach_Event(txn, [&](auto &ev){
+                    if (filterGroup.doesMatch(ev.flat_nested())) valid = false;
+                    return valid;
+                }, false, cachedLatestEventId + 1);
+            }
+
+            if (!valid) {
+                erase(key);
+                misses++;
+                return false;
+            }
+
+            extend(key, cachedLatestEventId, latestEventId);
+            extensions++;
+        }
+
+        eventPayloads.clear();
+        eventPayloads.reserve(levIds.size());
+
+        for (auto levId : levIds) {
+            std::string_view eventPayload;
+
+            if (!env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(levId), eventPayload)) {
+                // A result has been deleted
+                erase(key);
+                misses++;
+                return false;
+            }
+
+            eventPayloads.push_back(eventPayload);
+        }
+
+        hits++;
+        return true;
+    }
+
+    // Copies out the entry's levIds and watermark
+    bool get(const std::string &key, std::vector<uint64_t> &levIds, uint64_t &latestEventId) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto f = entries.find(key);
+        if (f == entries.end()) return false;
+
+        lru.splice(lru.begin(), lru, f->second);
+        levIds = f->second->levIds;
+        latestEventId = f->second->latestEventId;
+
+        return true;
+    }
+
+    // Advances an entry's watermark, unless it was replaced or erased in the meantime
+    void extend(const std::string &key, uint64_t prevLatestEventId, uint64_t newLatestEventId) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto f = entries.find(key);
+        if (f == entries.end() || f->second->latestEventId != prevLatestEventId) return;
+
+        f->second->latestEventId = newLatestEventId;
+    }
+
+    void erase(const std::string &key) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto f = entries.find(key);
+        if (f == entries.end()) return;
+
+        eraseEntry(f->second);
+        invalidations++;
+    }
+
+    void add(std::string key, std::vector<uint64_t> levIds, uint64_t latestEventId, size_t maxEntries, size_t maxBytes) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (maxEntries == 0) return;
+
+        {
+            auto f = entries.find(key);
+            if (f != entries.end()) {
+                // Keep whichever result is more recent
+                if (f->second->latestEventId >= latestEventId) return;
+                eraseEntry(f->second);
+            }
+        }
+
+        lru.emplace_front(Entry{ std::move(key), std::move(levIds), latestEventId });
+        entries.emplace(lru.front().key, lru.begin());
+        currBytes += lru.front().bytes();
+
+        while (lru.size() > maxEntries || (currBytes > maxBytes && lru.size() > 0)) {
+            eraseEntry(std::prev(lru.end()));
+        }
+
+        numEntries = lru.size();
+        numBytes = currBytes;
+    }
+
+  private:
+    void eraseEntry(std::list<Entry>::iterator it) {
+        currBytes -= it->bytes();
+        entries.erase(std::string_view(it->key));
+        lru.erase(it);
+
+        numEntries = lru.size();
+        numBytes = currBytes;
+    }
+};
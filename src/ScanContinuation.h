@@ -0,0 +1,114 @@
+#pragma once
+
+#include "golpe.h"
+
+
+// Where each cursor of a DBScan stopped, so that a later scan of the same filter can carry on from there. Given to
+// clients as an opaque token at EOSE, see NostrFilter::wantsContinuation
+//
+// Encoding: version byte, filter hash (uint64), plan byte, plan tag name, number of cursors (uint32), then for
+// each cursor a Type byte followed by:
+//   Key: key length (uint16), key, val (uint64)
+//   Intersect: created (uint64), levId (uint64)
+// Integers are native byte order, since tokens are only meaningful to the relay that issued them.
+
+struct ScanContinuation {
+    static const uint8_t VERSION = 1;
+
+    struct Position {
+        enum class Type : uint8_t {
+            Done = 0, // cursor has nothing more to return
+            Key = 1, // resume an index cursor at (key, levId), inclusive
+            Intersect = 2, // resume an intersection cursor at (created, levId), inclusive
+        };
+
+        Type type = Type::Done;
+        std::string key;
+        uint64_t created = 0;
+        uint64_t levId = 0;
+    };
+
+    uint64_t filterHash = 0;
+    uint8_t plan = 0; // DBScan::IndexPlan
+    char planTagName = '\0';
+    std::vector<Position> positions;
+
+    std::string encode() const {
+        std::string output;
+
+        auto addInt = [&](auto n){
+            output += std::string_view(reinterpret_cast<const char*>(&n), sizeof(n));
+        };
+
+        addInt(VERSION);
+        addInt(filterHash);
+        addInt(plan);
+        output += planTagName;
+        addInt((uint32_t)positions.size());
+
+        for (const auto &p : positions) {
+            addInt((uint8_t)p.type);
+
+            if (p.type == Position::Type::Key) {
+                addInt((uint16_t)p.key.size());
+                output += p.key;
+                addInt(p.levId);
+            } else if (p.type == Position::Type::Intersect) {
+                addInt(p.created);
+                addInt(p.levId);
+            }
+        }
+
+        return output;
+    }
+
+    static ScanContinuation decode(std::string_view s) {
+        ScanContinuation output;
+
+        auto take = [&](size_t n){
+            if (s.size() < n) throw herr("invalid cursor: truncated");
+            auto v = s.substr(0, n);
+            s = s.substr(n);
+            return v;
+        };
+
+        auto getInt = [&]<typename T>(T &n){
+            memcpy(&n, take(sizeof(T)).data(), sizeof(T));
+        };
+
+        uint8_t version;
+        getInt(version);
+        if (version != VERSION) throw herr("invalid cursor: unsupported version");
+
+        getInt(output.filterHash);
+        getInt(output.plan);
+        output.planTagName = take(1)[0];
+
+        uint32_t numPositions;
+        getInt(numPositions);
+
+        for (uint32_t i = 0; i < numPositions; i++) {
+            auto &p = output.positions.emplace_back();
+
+            uint8_t type;
+            getInt(type);
+            p.type = (Position::Type)type;
+
+            if (p.type == Position::Type::Key) {
+                uint16_t keySize;
+                getInt(keySize);
+                p.key = std::string(take(keySize));
+                getInt(p.levId);
+            } else if (p.type == Position::Type::Intersect) {
+                getInt(p.created);
+                getInt(p.levId);
+            } else if (p.type != Position::Type::Done) {
+                throw herr("invalid cursor: bad position type");
+            }
+        }
+
+        if (s.size()) throw herr("invalid cursor: trailing data");
+
+        return output;
+    }
+};
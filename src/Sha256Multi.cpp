@@ -0,0 +1,309 @@
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <openssl/sha.h>
+
+#include "Sha256Multi.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define STRFRY_SHA256_X86 1
+#endif
+
+
+alignas(64) static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H256[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+
+// Final 1 or 2 blocks of a message: remaining bytes, 0x80, zero padding, then big-endian bit length
+
+struct PaddedTail {
+    uint8_t buf[128];
+    size_t numFullBlocks;
+    size_t numBlocks;
+
+    PaddedTail(std::string_view msg) {
+        numFullBlocks = msg.size() / 64;
+        size_t rem = msg.size() % 64;
+        size_t tailBlocks = rem + 9 <= 64 ? 1 : 2;
+        numBlocks = numFullBlocks + tailBlocks;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, msg.data() + numFullBlocks * 64, rem);
+        buf[rem] = 0x80;
+
+        uint64_t bits = (uint64_t)msg.size() * 8;
+        uint8_t *lenPtr = buf + tailBlocks * 64 - 8;
+        for (size_t i = 0; i < 8; i++) lenPtr[i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+
+    const uint8_t *block(const uint8_t *msg, size_t b) const {
+        return b < numFullBlocks ? msg + b * 64 : buf + (b - numFullBlocks) * 64;
+    }
+};
+
+static inline void storeBe32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+
+
+static void sha256Generic(std::string_view input, unsigned char *output) {
+    SHA256(reinterpret_cast<const unsigned char*>(input.data()), input.size(), output);
+}
+
+
+
+#ifdef STRFRY_SHA256_X86
+
+// Based on the public-domain SHA-NI reference code by Intel and Jeffrey Walton
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256ShaNiBlocks(uint32_t state[8], const uint8_t *block) {
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i TMP = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i STATE1 = _mm_loadu_si128((const __m128i*)&state[4]);
+
+    TMP = _mm_shuffle_epi32(TMP, 0xB1); // CDAB
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B); // EFGH
+    __m128i STATE0 = _mm_alignr_epi8(TMP, STATE1, 8); // ABEF
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); // CDGH
+
+    __m128i ABEF_SAVE = STATE0;
+    __m128i CDGH_SAVE = STATE1;
+
+    __m128i M[4];
+
+    for (int i = 0; i < 16; i++) {
+        if (i < 4) M[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16 * i)), MASK);
+
+        __m128i &cur = M[i % 4];
+
+        __m128i MSG = _mm_add_epi32(cur, _mm_load_si128((const __m128i*)&K256[4 * i]));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+
+        if (i >= 3 && i <= 14) {
+            __m128i &next = M[(i + 1) % 4];
+            TMP = _mm_alignr_epi8(cur, M[(i + 3) % 4], 4);
+            next = _mm_add_epi32(next, TMP);
+            next = _mm_sha256msg2_epu32(next, cur);
+        }
+
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+        if (i >= 1 && i <= 12) {
+            __m128i &prev = M[(i + 3) % 4];
+            prev = _mm_sha256msg1_epu32(prev, cur);
+        }
+    }
+
+    STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+    STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B); // FEBA
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1); // DCHG
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); // DCBA
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8); // ABEF
+
+    _mm_storeu_si128((__m128i*)&state[0], STATE0);
+    _mm_storeu_si128((__m128i*)&state[4], STATE1);
+}
+
+static void sha256ShaNi(std::string_view input, unsigned char *output) {
+    uint32_t state[8];
+    memcpy(state, H256, sizeof(state));
+
+    PaddedTail tail(input);
+    auto *msg = reinterpret_cast<const uint8_t*>(input.data());
+
+    for (size_t b = 0; b < tail.numBlocks; b++) sha256ShaNiBlocks(state, tail.block(msg, b));
+
+    for (size_t i = 0; i < 8; i++) storeBe32(output + 4 * i, state[i]);
+}
+
+
+
+// 8 messages at once, each in its own 32-bit lane. Lanes whose message has fewer blocks
+// than the longest one are fed a dummy block, and their state update is masked off.
+
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n))
+
+__attribute__((target("avx2")))
+static void sha256Avx2x8(const std::string_view *inputs, size_t numInputs, unsigned char *output) {
+    static const uint8_t zeroBlock[64] = {};
+
+    const uint8_t *msgs[8];
+    PaddedTail *tails[8];
+    alignas(PaddedTail) uint8_t tailStorage[8][sizeof(PaddedTail)];
+    size_t maxBlocks = 0;
+
+    for (size_t l = 0; l < 8; l++) {
+        std::string_view input = l < numInputs ? inputs[l] : std::string_view("");
+        msgs[l] = reinterpret_cast<const uint8_t*>(input.data());
+        tails[l] = new (tailStorage[l]) PaddedTail(input);
+        if (l < numInputs && tails[l]->numBlocks > maxBlocks) maxBlocks = tails[l]->numBlocks;
+    }
+
+    __m256i s[8];
+    for (size_t i = 0; i < 8; i++) s[i] = _mm256_set1_epi32((int)H256[i]);
+
+    for (size_t b = 0; b < maxBlocks; b++) {
+        const uint8_t *p[8];
+        int32_t activeMask[8];
+
+        for (size_t l = 0; l < 8; l++) {
+            bool active = l < numInputs && b < tails[l]->numBlocks;
+            p[l] = active ? tails[l]->block(msgs[l], b) : zeroBlock;
+            activeMask[l] = active ? -1 : 0;
+        }
+
+        __m256i mask = _mm256_loadu_si256((const __m256i*)activeMask);
+
+        __m256i W[16];
+
+        for (size_t t = 0; t < 16; t++) {
+            uint32_t w[8];
+            for (size_t l = 0; l < 8; l++) {
+                uint32_t v;
+                memcpy(&v, p[l] + 4 * t, 4);
+                w[l] = __builtin_bswap32(v);
+            }
+            W[t] = _mm256_loadu_si256((const __m256i*)w);
+        }
+
+        __m256i a = s[0], bb = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+        for (size_t t = 0; t < 64; t++) {
+            if (t >= 16) {
+                __m256i w15 = W[(t - 15) & 15];
+                __m256i w2 = W[(t - 2) & 15];
+                __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(ROTR(w15, 7), ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(ROTR(w2, 17), ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+                W[t & 15] = _mm256_add_epi32(_mm256_add_epi32(W[t & 15], sigma0), _mm256_add_epi32(W[(t - 7) & 15], sigma1));
+            }
+
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i T1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_set1_epi32((int)K256[t]))), W[t & 15]);
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22));
+            __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, bb), _mm256_and_si256(a, c)), _mm256_and_si256(bb, c));
+            __m256i T2 = _mm256_add_epi32(S0, maj);
+
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, T1);
+            d = c;
+            c = bb;
+            bb = a;
+            a = _mm256_add_epi32(T1, T2);
+        }
+
+        __m256i res[8] = { a, bb, c, d, e, f, g, h };
+        for (size_t i = 0; i < 8; i++) s[i] = _mm256_blendv_epi8(s[i], _mm256_add_epi32(s[i], res[i]), mask);
+    }
+
+    for (size_t i = 0; i < 8; i++) {
+        uint32_t words[8];
+        _mm256_storeu_si256((__m256i*)words, s[i]);
+        for (size_t l = 0; l < numInputs; l++) storeBe32(output + 32 * l + 4 * i, words[l]);
+    }
+}
+
+#undef ROTR
+
+
+static bool cpuHasShaNi() {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    bool sse41 = c & (1 << 19);
+    bool ssse3 = c & (1 << 9);
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return sse41 && ssse3 && (b & (1 << 29));
+}
+
+static bool cpuHasAvx2() {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    bool osxsave = c & (1 << 27);
+    bool avx = c & (1 << 28);
+    if (!osxsave || !avx) return false;
+
+    uint32_t xcr0Lo, xcr0Hi;
+    __asm__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    if ((xcr0Lo & 6) != 6) return false; // OS saves YMM registers
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return b & (1 << 5);
+}
+
+#endif
+
+
+
+bool sha256ImplSupported(Sha256Impl impl) {
+#ifdef STRFRY_SHA256_X86
+    static const bool haveShaNi = cpuHasShaNi();
+    static const bool haveAvx2 = cpuHasAvx2();
+#else
+    static const bool haveShaNi = false;
+    static const bool haveAvx2 = false;
+#endif
+
+    if (impl == Sha256Impl::ShaNi) return haveShaNi;
+    if (impl == Sha256Impl::Avx2) return haveAvx2;
+    return true;
+}
+
+Sha256Impl sha256BestImpl() {
+    static const Sha256Impl best = [](){
+        if (sha256ImplSupported(Sha256Impl::ShaNi)) return Sha256Impl::ShaNi;
+        if (sha256ImplSupported(Sha256Impl::Avx2)) return Sha256Impl::Avx2;
+        return Sha256Impl::Generic;
+    }();
+
+    return best;
+}
+
+const char *sha256ImplName(Sha256Impl impl) {
+    if (impl == Sha256Impl::Auto) impl = sha256BestImpl();
+
+    if (impl == Sha256Impl::ShaNi) return "SHA-NI";
+    else if (impl == Sha256Impl::Avx2) return "AVX2";
+    else return "Generic";
+}
+
+void sha256Multi(const std::string_view *inputs, size_t numInputs, unsigned char *output, Sha256Impl impl) {
+    if (impl == Sha256Impl::Auto || !sha256ImplSupported(impl)) impl = sha256BestImpl();
+
+#ifdef STRFRY_SHA256_X86
+    if (impl == Sha256Impl::ShaNi) {
+        for (size_t i = 0; i < numInputs; i++) sha256ShaNi(inputs[i], output + 32 * i);
+        return;
+    } else if (impl == Sha256Impl::Avx2) {
+        for (size_t i = 0; i < numInputs; i += 8) sha256Avx2x8(inputs + i, std::min(numInputs - i, (size_t)8), output + 32 * i);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < numInputs; i++) sha256Generic(inputs[i], output + 32 * i);
+}
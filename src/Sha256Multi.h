@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string_view>
+
+
+// SHA-256 of many independent messages at once, used for checking event ids in batches
+//
+// The implementation is picked at startup by CPU dispatch:
+//   * SHA-NI: hardware SHA extensions, one message at a time
+//   * AVX2: 8 messages hashed in parallel, one per 32-bit lane
+//   * Generic: OpenSSL's SHA256(), one message at a time
+
+enum class Sha256Impl {
+    Auto,
+    Generic,
+    ShaNi,
+    Avx2,
+};
+
+// Writes inputs.size() * 32 bytes to output
+void sha256Multi(const std::string_view *inputs, size_t numInputs, unsigned char *output, Sha256Impl impl = Sha256Impl::Auto);
+
+// The implementation that Sha256Impl::Auto resolves to on this CPU
+Sha256Impl sha256BestImpl();
+bool sha256ImplSupported(Sha256Impl impl);
+const char *sha256ImplName(Sha256Impl impl);
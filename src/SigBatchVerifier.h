@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string.h>
+
+#include <random>
+
+#include <secp256k1_schnorrsig.h>
+
+#if __has_include(<secp256k1_schnorrsig_batch.h>)
+#include <secp256k1_batch.h>
+#include <secp256k1_schnorrsig_batch.h>
+#define STRFRY_SECP256K1_BATCH 1
+#endif
+
+#include "golpe.h"
+
+#include "events.h"
+
+
+// Verifies the signatures of many events together
+//
+// When libsecp256k1 was built with the (experimental) batch module, all signatures are checked
+// with one multi-scalar multiplication, which is substantially cheaper than checking them one
+// at a time. If a batch fails, it is bisected so that every bad signature is still identified
+// individually. Without the batch module, signatures are verified one at a time.
+
+struct SigBatchVerifier : NonCopyable {
+    struct Item {
+        std::string sig;
+        std::string hash;
+        std::string pubkey;
+        std::string error; // after verify(): empty if signature is valid
+    };
+
+    std::vector<Item> items;
+    bool useBatch = true; // if false, always verify individually
+    XOnlyPubkeyCache *pubkeyCache = nullptr; // optional, owned by the calling thread
+
+    uint64_t numBatchVerifies = 0;
+    uint64_t numSingleVerifies = 0;
+
+    static constexpr bool batchSupported() {
+#ifdef STRFRY_SECP256K1_BATCH
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void add(std::string sig, std::string_view hash, std::string_view pubkey) {
+        items.emplace_back(Item{ std::move(sig), std::string(hash), std::string(pubkey), "" });
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    void clear() {
+        items.clear();
+    }
+
+    void verify(secp256k1_context *ctx) {
+        verifyRange(ctx, 0, items.size(), false);
+    }
+
+  private:
+    std::mt19937_64 rng{std::random_device{}()};
+
+    void verifySingle(secp256k1_context *ctx, Item &item) {
+        numSingleVerifies++;
+
+        try {
+            if (!verifySig(ctx, item.sig, item.hash, item.pubkey, pubkeyCache)) item.error = "bad signature";
+        } catch (std::exception &e) {
+            item.error = e.what();
+        }
+    }
+
+    // knownBad: the caller already determined this range contains at least one invalid signature
+
+    void verifyRange(secp256k1_context *ctx, size_t begin, size_t end, bool knownBad) {
+        if (begin == end) return;
+
+        if (end - begin == 1 || !batchSupported() || !useBatch) {
+            for (size_t i = begin; i < end; i++) verifySingle(ctx, items[i]);
+            return;
+        }
+
+        if (!knownBad && verifyBatch(ctx, begin, end)) return;
+
+        size_t mid = begin + (end - begin) / 2;
+        bool leftValid = verifyBatch(ctx, begin, mid);
+
+        if (!leftValid && mid - begin > 1) verifyRange(ctx, begin, mid, true);
+        verifyRange(ctx, mid, end, leftValid); // if left half is valid, the bad signature must be in the right
+    }
+
+    // Returns true only if every signature in the range is valid. Single items are fully verified, so errors are recorded
+
+    bool verifyBatch(secp256k1_context *ctx, size_t begin, size_t end) {
+        if (end - begin == 1) {
+            verifySingle(ctx, items[begin]);
+            return items[begin].error.empty();
+        }
+
+#ifdef STRFRY_SECP256K1_BATCH
+        numBatchVerifies++;
+
+        unsigned char auxRand[16];
+        for (size_t i = 0; i < sizeof(auxRand); i += 8) {
+            uint64_t r = rng();
+            memcpy(auxRand + i, &r, 8);
+        }
+
+        secp256k1_batch *batch = secp256k1_batch_create(ctx, 2 * (end - begin), auxRand);
+        if (!batch) return false;
+
+        bool ok = true;
+
+        for (size_t i = begin; i < end; i++) {
+            auto &item = items[i];
+            secp256k1_xonly_pubkey pubkeyParsed;
+
+            if (item.sig.size() != 64 || item.hash.size() != 32 || item.pubkey.size() != 32 ||
+                !(pubkeyCache ? pubkeyCache->parse(ctx, &pubkeyParsed, item.pubkey) : secp256k1_xonly_pubkey_parse(ctx, &pubkeyParsed, (const uint8_t*)item.pubkey.data())) ||
+                !secp256k1_batch_add_schnorrsig(ctx, batch, (const uint8_t*)item.sig.data(), (const uint8_t*)item.hash.data(), item.hash.size(), &pubkeyParsed)) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (ok) ok = secp256k1_batch_verify(ctx, batch);
+
+        secp256k1_batch_destroy(ctx, batch);
+
+        return ok;
+#else
+        return false;
+#endif
+    }
+};
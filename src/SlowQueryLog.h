@@ -0,0 +1,62 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <fstream>
+
+#include "golpe.h"
+
+
+// Records of REQs whose initial scans went over relay.logging.slowQuery* thresholds. The most recent are kept in
+// memory, and each is optionally appended as a line to a JSONL file. Shared by all ReqWorker threads
+
+struct SlowQueryLog : NonCopyable {
+    struct Record {
+        uint64_t timeUs;
+        uint64_t work;
+        std::string json;
+    };
+
+    std::mutex mutex;
+    std::deque<Record> ring;
+    size_t maxRecords = 0;
+    std::ofstream file;
+    std::atomic<uint64_t> numRecorded = 0;
+
+    void init(size_t maxRecords_, const std::string &path) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        maxRecords = maxRecords_;
+
+        if (path.size()) {
+            file.open(path, std::ios::app);
+            if (!file) throw herr("couldn't open slow query log: ", path);
+        }
+    }
+
+    void add(uint64_t timeUs, uint64_t work, std::string json) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        numRecorded++;
+
+        if (file.is_open()) {
+            file << json << "\n";
+            file.flush();
+        }
+
+        if (maxRecords == 0) return;
+        if (ring.size() >= maxRecords) ring.pop_front();
+        ring.emplace_back(Record{ timeUs, work, std::move(json) });
+    }
+
+    // The n slowest records currently in the ring
+    std::vector<Record> slowest(size_t n) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        std::vector<Record> output(ring.begin(), ring.end());
+        std::sort(output.begin(), output.end(), [](const auto &a, const auto &b){ return a.timeUs > b.timeUs; });
+        if (output.size() > n) output.resize(n);
+
+        return output;
+    }
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+
 #include <parallel_hashmap/phmap_utils.h>
 
 #include "filters.h"
@@ -49,15 +51,33 @@ namespace std {
 struct Subscription : NonCopyable {
     Subscription(uint64_t connId_, std::string subId_, NostrFilterGroup filterGroup_) : connId(connId_), subId(subId_), filterGroup(filterGroup_) {}
 
+    Subscription(Subscription &&o) noexcept : connId(o.connId), subId(o.subId), filterGroup(std::move(o.filterGroup)), ipAddr(std::move(o.ipAddr)),
+                                              latestEventId(o.latestEventId), removed(o.removed.load()) {}
+
+    Subscription &operator=(Subscription &&o) noexcept {
+        connId = o.connId;
+        subId = o.subId;
+        filterGroup = std::move(o.filterGroup);
+        ipAddr = std::move(o.ipAddr);
+        latestEventId = o.latestEventId;
+        removed = o.removed.load();
+        return *this;
+    }
+
     // Params
 
     uint64_t connId;
     SubId subId;
     NostrFilterGroup filterGroup;
+    std::string ipAddr; // raw bytes of the client's IP, if known
 
     // State
 
     uint64_t latestEventId = MAX_U64;
+
+    // Set by QueryScheduler as soon as the subscription is closed or replaced, so that nothing more is sent to it.
+    // Atomic because its query may be running a timeslice on another ReqWorker thread at the time
+    std::atomic<bool> removed = false;
 };
 
 
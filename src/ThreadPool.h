@@ -3,14 +3,14 @@
 #include <hoytech/protected_queue.h>
 
 
-template <typename M>
+template <typename M, typename Queue = hoytech::protected_queue<M>>
 struct ThreadPool {
     uint64_t numThreads;
 
     struct Thread {
         uint64_t id;
         std::thread thread;
-        hoytech::protected_queue<M> inbox;
+        Queue inbox;
     };
 
     std::deque<Thread> pool;
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+
+// Same interface as hoytech::protected_queue, plus pop_all_until(), which blocks until the queue is
+// non-empty or a deadline passes. Used by the writer to fill batches without polling its inbox.
+
+template <typename T>
+class TimedQueue {
+  public:
+    void push_move(T &&val) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.emplace_back(std::move(val));
+        }
+
+        cv.notify_one();
+    }
+
+    void push_move_all(std::vector<T> &vals) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &v : vals) queue.emplace_back(std::move(v));
+        }
+
+        vals.clear();
+        cv.notify_one();
+    }
+
+    std::deque<T> pop_all() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]{ return !queue.empty(); });
+        return take();
+    }
+
+    std::deque<T> pop_all_no_wait() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return take();
+    }
+
+    // Returns an empty deque if nothing arrived before the deadline
+
+    std::deque<T> pop_all_until(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_until(lock, deadline, [&]{ return !queue.empty(); });
+        return take();
+    }
+
+  private:
+    std::deque<T> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::deque<T> take() {
+        std::deque<T> output;
+        std::swap(output, queue);
+        return output;
+    }
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string_view>
+
+#include "golpe.h"
+
+
+// How write transactions are made durable, see relay.writer.durability
+//
+//   * Sync: every commit is fsynced before its OKs are sent (LMDB's default)
+//   * Periodic: commits aren't fsynced. A background thread calls mdb_env_sync() at a fixed interval
+//   * Async: commits aren't fsynced, and the OS writes back dirty pages on its own schedule
+//
+// Periodic and Async can lose recently committed transactions on a system crash, and since LMDB is
+// running with MDB_NOSYNC, a filesystem that doesn't preserve write order could leave the DB corrupted.
+
+enum class WriterDurability {
+    Sync,
+    Periodic,
+    Async,
+};
+
+inline WriterDurability parseWriterDurability(std::string_view s) {
+    if (s == "sync") return WriterDurability::Sync;
+    if (s == "periodic") return WriterDurability::Periodic;
+    if (s == "async") return WriterDurability::Async;
+    throw herr("unknown durability mode: ", s);
+}
+
+inline const char *writerDurabilityName(WriterDurability d) {
+    if (d == WriterDurability::Sync) return "sync";
+    if (d == WriterDurability::Periodic) return "periodic";
+    return "async";
+}
+
+// LMDB env flags for a mode. Callers that switch modes should clear MDB_NOSYNC first
+inline unsigned int writerDurabilityEnvFlags(WriterDurability d) {
+    return d == WriterDurability::Sync ? 0 : MDB_NOSYNC;
+}
@@ -5,6 +5,7 @@
 #include "golpe.h"
 
 #include "events.h"
+#include "EventBatchVerifier.h"
 
 
 struct WriterPipelineInput {
@@ -32,6 +33,8 @@ struct WriterPipeline {
     std::atomic<bool> shutdownComplete = false;
 
     std::atomic<uint64_t> numLive = 0;
+    std::atomic<uint64_t> pubkeyCacheHits = 0;
+    std::atomic<uint64_t> pubkeyCacheMisses = 0;
     std::condition_variable backpressureCv;
     std::mutex backpressureMutex;
 
@@ -42,11 +45,44 @@ struct WriterPipeline {
 
             secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 
+            // Ids and signatures of each pop_all() batch are checked together
+
+            XOnlyPubkeyCache pubkeyCache;
+            EventBatchVerifier verifier;
+            verifier.sigVerifier.pubkeyCache = &pubkeyCache;
+            std::vector<WriterPipelineInput*> pending; // parallel to verifier.items
+            std::vector<EventToWrite> pendingEvents;
+
+            auto verifyPending = [&]{
+                if (pending.empty()) return;
+
+                verifier.verify(secpCtx);
+
+                pubkeyCacheHits += pubkeyCache.hits;
+                pubkeyCacheMisses += pubkeyCache.misses;
+                pubkeyCache.hits = pubkeyCache.misses = 0;
+
+                for (size_t i = 0; i < pending.size(); i++) {
+                    if (verifier.items[i].error.size()) {
+                        LW << "Rejected event: " << pending[i]->eventJson << " reason: " << verifier.items[i].error;
+                        numLive--;
+                        continue;
+                    }
+
+                    writerInbox.push_move(std::move(pendingEvents[i]));
+                }
+
+                verifier.clear();
+                pending.clear();
+                pendingEvents.clear();
+            };
+
             while (1) {
                 auto msgs = validatorInbox.pop_all();
 
                 for (auto &m : msgs) {
                     if (m.eventJson.is_null()) {
+                        verifyPending();
                         shutdownRequested = true;
                         writerInbox.push_move({});
                         shutdownCv.notify_all();
@@ -55,17 +91,23 @@ struct WriterPipeline {
 
                     std::string flatStr;
                     std::string jsonStr;
+                    DeferredEventChecks checks;
 
                     try {
-                        parseAndVerifyEvent(m.eventJson, secpCtx, true, true, flatStr, jsonStr);
+                        parseAndVerifyEvent(m.eventJson, secpCtx, true, true, flatStr, jsonStr, &checks);
                     } catch (std::exception &e) {
                         LW << "Rejected event: " << m.eventJson << " reason: " << e.what();
                         numLive--;
                         continue;
                     }
 
-                    writerInbox.push_move({ std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), m.sourceType, std::move(m.sourceInfo) });
+                    auto *flat = flatStrToFlatEvent(flatStr);
+                    verifier.add(std::move(checks), sv(flat->id()), sv(flat->pubkey()));
+                    pending.push_back(&m);
+                    pendingEvents.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), m.sourceType, std::move(m.sourceInfo));
                 }
+
+                verifyPending();
             }
         });
 
@@ -138,7 +180,11 @@ struct WriterPipeline {
                     }
                 }
 
-                if (written || dups) LI << "Writer: added: " << written << " dups: " << dups;
+                if (written || dups) {
+                    uint64_t hits = pubkeyCacheHits, misses = pubkeyCacheMisses;
+                    LI << "Writer: added: " << written << " dups: " << dups
+                       << " (pubkey cache hits: " << hits << " misses: " << misses << ")";
+                }
 
                 if (shutdownComplete) {
                     flushInbox.push_move(true);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string.h>
+
+#include <bit>
+
+#include <secp256k1_extrakeys.h>
+
+#include "golpe.h"
+
+
+// Bounded cache of parsed x-only public keys
+//
+// secp256k1_xonly_pubkey_parse() decompresses a curve point, which is a noticeable part of the cost
+// of verifying a signature. Most events come from a relatively small set of active authors, so each
+// verifying thread keeps its own cache of parsed keys. Not thread-safe.
+//
+// The cache is 2-way set associative. Pubkeys are uniformly distributed, so their leading bytes are
+// used directly as the set index, and the least recently used entry of a set is replaced on a miss.
+
+struct XOnlyPubkeyCache : NonCopyable {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    // numEntries is rounded up to a power of 2. 0 disables caching
+    XOnlyPubkeyCache(size_t numEntries = 8192) {
+        if (numEntries == 0) return;
+        numSets = std::bit_ceil(std::max(numEntries / 2, (size_t)1));
+        entries.resize(numSets * 2);
+    }
+
+    // Returns false if the pubkey is invalid. Invalid pubkeys are not cached
+    bool parse(const secp256k1_context *ctx, secp256k1_xonly_pubkey *out, std::string_view pubkey) {
+        if (pubkey.size() != 32) return false;
+
+        if (numSets == 0) {
+            misses++;
+            return secp256k1_xonly_pubkey_parse(ctx, out, (const uint8_t*)pubkey.data());
+        }
+
+        uint64_t prefix;
+        memcpy(&prefix, pubkey.data(), sizeof(prefix));
+        Entry *set = &entries[(prefix & (numSets - 1)) * 2];
+
+        for (size_t i = 0; i < 2; i++) {
+            if (set[i].lastUse && memcmp(set[i].pubkey, pubkey.data(), 32) == 0) {
+                hits++;
+                set[i].lastUse = ++useCounter;
+                *out = set[i].parsed;
+                return true;
+            }
+        }
+
+        misses++;
+
+        if (!secp256k1_xonly_pubkey_parse(ctx, out, (const uint8_t*)pubkey.data())) return false;
+
+        Entry &victim = set[0].lastUse <= set[1].lastUse ? set[0] : set[1];
+        memcpy(victim.pubkey, pubkey.data(), 32);
+        victim.parsed = *out;
+        victim.lastUse = ++useCounter;
+
+        return true;
+    }
+
+    void clear() {
+        for (auto &e : entries) e.lastUse = 0;
+    }
+
+  private:
+    struct Entry {
+        uint8_t pubkey[32];
+        secp256k1_xonly_pubkey parsed;
+        uint64_t lastUse = 0; // 0 means empty
+    };
+
+    std::vector<Entry> entries;
+    size_t numSets = 0;
+    uint64_t useCounter = 0;
+};
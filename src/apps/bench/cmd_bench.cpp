@@ -0,0 +1,829 @@
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <dlfcn.h>
+
+#include <docopt.h>
+#include <openssl/sha.h>
+#include "golpe.h"
+
+#include "events.h"
+#include "EventParser.h"
+#include "SigBatchVerifier.h"
+#include "Sha256Multi.h"
+#include "WriterDurability.h"
+#include "DBQuery.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      bench parse [--iterations=<iterations>]
+      bench verify [--iterations=<iterations>] [--batch-sizes=<batch-sizes>]
+      bench sha256 [--iterations=<iterations>]
+      bench flat [--iterations=<iterations>] [--count-allocs]
+      bench pubkeys [--iterations=<iterations>] [--cache-size=<cache-size>] [--zipf=<zipf>] [--lookups=<lookups>]
+      bench write [--iterations=<iterations>] [--modes=<modes>] [--batch-size=<batch-size>] [--sync-interval=<sync-interval>]
+      bench keymatch [--iterations=<iterations>] [--keys=<keys>]
+      bench merge [--iterations=<iterations>] [--cursors=<cursors>] [--candidates=<candidates>]
+
+    Options:
+      --iterations=<iterations>    Number of passes over the input events [default: 10]
+      --batch-sizes=<batch-sizes>  Comma-separated batch sizes for SigBatchVerifier [default: 1,8,32,128]
+      --count-allocs               Fail if heap allocations happen in steady state. Needs the test/allocCounter.c shim
+      --cache-size=<cache-size>    Number of entries in the XOnlyPubkeyCache [default: 8192]
+      --zipf=<zipf>                Exponent of the Zipf distribution used to draw synthetic pubkey lookups [default: 1.1]
+      --lookups=<lookups>          Number of synthetic pubkey lookups [default: 1000000]
+      --modes=<modes>              Comma-separated writer durability modes [default: sync,periodic,async]
+      --batch-size=<batch-size>    Events per write txn [default: 100]
+      --sync-interval=<sync-interval>  Milliseconds between fsyncs in periodic mode [default: 1000]
+      --keys=<keys>                Number of synthetic index keys per index [default: 1000000]
+      --cursors=<cursors>          Comma-separated numbers of scan cursors to merge [default: 1,100,5000]
+      --candidates=<candidates>    Total synthetic candidates across all cursors [default: 1000000]
+
+    Events are read as jsonl from standard input (except by `bench keymatch` and `bench merge`). `bench write` inserts into the configured DB, which must be empty.
+)";
+
+
+// Counting heap allocations for `bench flat --count-allocs` is done by the LD_PRELOAD shim in test/allocCounter.c
+// (see test/flatAllocTest.pl), so that the strfry binary itself keeps the normal allocator
+
+struct AllocCounter {
+    void (*enable)(int) = nullptr;
+    uint64_t (*total)() = nullptr;
+
+    AllocCounter() {
+        enable = reinterpret_cast<void(*)(int)>(dlsym(RTLD_DEFAULT, "allocCounterEnable"));
+        total = reinterpret_cast<uint64_t(*)()>(dlsym(RTLD_DEFAULT, "allocCounterTotal"));
+    }
+
+    bool available() const {
+        return enable && total;
+    }
+};
+
+
+static std::vector<std::string> readLines() {
+    std::vector<std::string> lines;
+    std::string line;
+
+    while (std::cin) {
+        std::getline(std::cin, line);
+        if (!line.size()) continue;
+        lines.emplace_back(std::move(line));
+    }
+
+    LI << "Loaded " << lines.size() << " events";
+
+    return lines;
+}
+
+static void reportRate(const char *desc, uint64_t numEvents, uint64_t bytes, uint64_t elapsedUs) {
+    double secs = (double)elapsedUs / 1e6;
+    if (secs == 0) secs = 1e-6;
+
+    std::string throughput;
+    if (bytes) throughput = std::string(", ") + renderSize((uint64_t)(bytes / secs)) + "/s";
+
+    LI << desc << ": " << (uint64_t)(numEvents / secs) << " events/s" << throughput
+       << " (" << elapsedUs << "us total)";
+}
+
+
+static void benchParse(const std::vector<std::string> &lines, uint64_t iterations) {
+    std::string flatStr, jsonStr, flatStr2, jsonStr2;
+    EventParser parser;
+
+    uint64_t totalBytes = 0;
+    for (const auto &l : lines) totalBytes += l.size();
+
+    // Check both paths agree before timing anything
+
+    uint64_t numFast = 0, numFallback = 0, numMismatch = 0, numInvalid = 0;
+
+    for (const auto &l : lines) {
+        std::string domHash;
+
+        try {
+            auto origJson = tao::json::from_string(l);
+            parseAndVerifyEvent(origJson, nullptr, false, false, flatStr, jsonStr);
+            domHash = nostrHash(origJson);
+        } catch (std::exception &e) {
+            numInvalid++;
+            if (parser.tryParse(l)) {
+                try {
+                    parseAndVerifyEvent(parser, nullptr, false, false, flatStr2, jsonStr2);
+                    LW << "Fast path accepted event rejected by DOM path: " << l;
+                    numMismatch++;
+                } catch (std::exception &) {
+                }
+            }
+            continue;
+        }
+
+        if (!parser.tryParse(l)) {
+            numFallback++;
+            continue;
+        }
+
+        numFast++;
+        parseAndVerifyEvent(parser, nullptr, false, false, flatStr2, jsonStr2);
+
+        auto preimage = parser.hashPreimage();
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char*>(preimage.data()), preimage.size(), hash);
+
+        if (flatStr != flatStr2 || jsonStr != jsonStr2 || domHash != std::string_view((char*)hash, sizeof(hash))) {
+            LW << "Output mismatch: " << l;
+            numMismatch++;
+        }
+    }
+
+    LI << "fast=" << numFast << " fallback=" << numFallback << " invalid=" << numInvalid << " mismatch=" << numMismatch;
+
+    // Timings include flatbuffer building, canonical JSON, and hashing the id preimage (but not signature verification)
+
+    {
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            for (const auto &l : lines) {
+                try {
+                    auto origJson = tao::json::from_string(l);
+                    parseAndVerifyEvent(origJson, nullptr, false, false, flatStr, jsonStr);
+                    nostrHash(origJson);
+                } catch (std::exception &) {
+                }
+            }
+        }
+
+        reportRate("tao::json DOM", lines.size() * iterations, totalBytes * iterations, hoytech::curr_time_us() - start);
+    }
+
+    {
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            for (const auto &l : lines) {
+                try {
+                    if (parser.tryParse(l)) {
+                        parseAndVerifyEvent(parser, nullptr, false, false, flatStr, jsonStr);
+                        auto preimage = parser.hashPreimage();
+                        unsigned char hash[SHA256_DIGEST_LENGTH];
+                        SHA256(reinterpret_cast<const unsigned char*>(preimage.data()), preimage.size(), hash);
+                    } else {
+                        auto origJson = tao::json::from_string(l);
+                        parseAndVerifyEvent(origJson, nullptr, false, false, flatStr, jsonStr);
+                        nostrHash(origJson);
+                    }
+                } catch (std::exception &) {
+                }
+            }
+        }
+
+        reportRate("EventParser", lines.size() * iterations, totalBytes * iterations, hoytech::curr_time_us() - start);
+    }
+
+    if (numMismatch) throw herr("fast path output differs from DOM path for ", numMismatch, " events");
+}
+
+
+struct SigToVerify {
+    std::string sig;
+    std::string id;
+    std::string pubkey;
+};
+
+static std::vector<SigToVerify> loadSigs(const std::vector<std::string> &lines) {
+    std::vector<SigToVerify> sigs;
+    std::string flatStr, jsonStr;
+
+    for (const auto &l : lines) {
+        try {
+            auto origJson = tao::json::from_string(l);
+            DeferredEventChecks checks;
+            parseAndVerifyEvent(origJson, nullptr, true, false, flatStr, jsonStr, &checks);
+            auto *flat = flatStrToFlatEvent(flatStr);
+            sigs.emplace_back(SigToVerify{ std::move(checks.sig), std::string(sv(flat->id())), std::string(sv(flat->pubkey())) });
+        } catch (std::exception &) {
+        }
+    }
+
+    LI << "Loaded " << sigs.size() << " signatures";
+
+    return sigs;
+}
+
+static void benchVerify(const std::vector<SigToVerify> &sigs, uint64_t iterations, const std::vector<uint64_t> &batchSizes) {
+    secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+
+    if (!SigBatchVerifier::batchSupported()) LW << "libsecp256k1 batch module not available: SigBatchVerifier will verify individually";
+
+    uint64_t numInvalid = 0;
+
+    {
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            for (const auto &s : sigs) {
+                if (!verifySig(secpCtx, s.sig, s.id, s.pubkey)) numInvalid++;
+            }
+        }
+
+        reportRate("verifySig", sigs.size() * iterations, 0, hoytech::curr_time_us() - start);
+    }
+
+    for (auto batchSize : batchSizes) {
+        if (batchSize == 0) continue;
+
+        SigBatchVerifier verifier;
+        uint64_t numBatchInvalid = 0;
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            for (size_t j = 0; j < sigs.size(); j += batchSize) {
+                for (size_t k = j; k < std::min(j + batchSize, sigs.size()); k++) {
+                    verifier.add(sigs[k].sig, sigs[k].id, sigs[k].pubkey);
+                }
+
+                verifier.verify(secpCtx);
+                for (const auto &item : verifier.items) if (item.error.size()) numBatchInvalid++;
+                verifier.clear();
+            }
+        }
+
+        std::string desc = std::string("SigBatchVerifier batchSize=") + std::to_string(batchSize);
+        reportRate(desc.c_str(), sigs.size() * iterations, 0, hoytech::curr_time_us() - start);
+        LI << "  batchVerifies=" << verifier.numBatchVerifies << " singleVerifies=" << verifier.numSingleVerifies;
+
+        if (numBatchInvalid != numInvalid) throw herr("SigBatchVerifier disagrees with verifySig: ", numBatchInvalid, " vs ", numInvalid, " invalid");
+    }
+
+    secp256k1_context_destroy(secpCtx);
+}
+
+
+static void benchSha256(const std::vector<std::string> &lines, uint64_t iterations) {
+    std::vector<std::string> preimages;
+    uint64_t totalBytes = 0;
+
+    for (const auto &l : lines) {
+        try {
+            preimages.emplace_back(nostrHashPreimage(tao::json::from_string(l)));
+            totalBytes += preimages.back().size();
+        } catch (std::exception &) {
+        }
+    }
+
+    std::vector<std::string_view> inputs(preimages.begin(), preimages.end());
+    std::vector<unsigned char> expected(inputs.size() * 32), output(inputs.size() * 32);
+
+    sha256Multi(inputs.data(), inputs.size(), expected.data(), Sha256Impl::Generic);
+
+    LI << "Best available implementation: " << sha256ImplName(Sha256Impl::Auto);
+
+    for (auto impl : { Sha256Impl::Generic, Sha256Impl::ShaNi, Sha256Impl::Avx2 }) {
+        if (!sha256ImplSupported(impl)) {
+            LI << sha256ImplName(impl) << ": not supported by this CPU";
+            continue;
+        }
+
+        sha256Multi(inputs.data(), inputs.size(), output.data(), impl);
+        if (output != expected) throw herr("sha256Multi output mismatch for ", sha256ImplName(impl));
+
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            sha256Multi(inputs.data(), inputs.size(), output.data(), impl);
+        }
+
+        reportRate(sha256ImplName(impl), inputs.size() * iterations, totalBytes * iterations, hoytech::curr_time_us() - start);
+    }
+}
+
+
+// Converting parsed events to flatbuffers should not allocate once the per-thread scratch buffers have
+// grown to fit. The first pass warms them up, and every later pass must do no allocations at all
+
+static void benchFlat(const std::vector<std::string> &lines, uint64_t iterations, bool countAllocs) {
+    AllocCounter counter;
+
+    if (countAllocs && !counter.available()) throw herr("--count-allocs needs the allocation counter shim: see test/flatAllocTest.pl");
+
+    auto setCounting = [&](bool on){
+        if (counter.available()) counter.enable(on);
+    };
+
+    auto numAllocs = [&]{
+        return counter.available() ? counter.total() : 0;
+    };
+
+    EventParser parser;
+    std::string flatStr;
+    std::vector<std::string_view> events;
+
+    for (const auto &l : lines) {
+        try {
+            if (!parser.tryParse(l)) continue;
+            nostrJsonToFlat(parser, flatStr);
+            events.push_back(l);
+        } catch (std::exception &) {
+        }
+    }
+
+    LI << "Using " << events.size() << " events accepted by EventParser";
+
+    {
+        uint64_t elapsed = 0;
+        uint64_t startAllocs = numAllocs();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            for (auto ev : events) {
+                parser.parse(ev);
+
+                uint64_t t = hoytech::curr_time_us();
+                setCounting(true);
+                std::string flat = nostrJsonToFlat(parser);
+                setCounting(false);
+                elapsed += hoytech::curr_time_us() - t;
+            }
+        }
+
+        reportRate("nostrJsonToFlat, new string", events.size() * iterations, 0, elapsed);
+        if (counter.available()) LI << "  allocations=" << (numAllocs() - startAllocs);
+    }
+
+    {
+        uint64_t elapsed = 0;
+        uint64_t steadyAllocs = 0;
+
+        for (uint64_t i = 0; i < iterations + 1; i++) {
+            uint64_t startAllocs = numAllocs();
+
+            for (auto ev : events) {
+                parser.parse(ev);
+
+                uint64_t t = hoytech::curr_time_us();
+                setCounting(true);
+                nostrJsonToFlat(parser, flatStr);
+                setCounting(false);
+                if (i > 0) elapsed += hoytech::curr_time_us() - t;
+            }
+
+            if (i > 0) steadyAllocs += numAllocs() - startAllocs;
+        }
+
+        reportRate("nostrJsonToFlat, re-used output", events.size() * iterations, 0, elapsed);
+
+        if (counter.available()) {
+            LI << "  steady-state allocations=" << steadyAllocs;
+            if (steadyAllocs) throw herr("nostrJsonToFlat allocated ", steadyAllocs, " times in steady state");
+        }
+    }
+}
+
+
+// First in the order the events were supplied, then with lookups drawn from a Zipf distribution over the
+// distinct pubkeys, to approximate a relay where a few authors produce most of the events
+
+static void benchPubkeys(const std::vector<SigToVerify> &sigs, uint64_t iterations, uint64_t cacheSize, double zipf, uint64_t numLookups) {
+    secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+
+    for (bool useCache : { false, true }) {
+        XOnlyPubkeyCache cache(cacheSize);
+        uint64_t start = hoytech::curr_time_us();
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            cache.clear(); // otherwise later iterations would all be hits
+
+            for (const auto &s : sigs) {
+                verifySig(secpCtx, s.sig, s.id, s.pubkey, useCache ? &cache : nullptr);
+            }
+        }
+
+        reportRate(useCache ? "verifySig, with cache" : "verifySig, no cache", sigs.size() * iterations, 0, hoytech::curr_time_us() - start);
+        if (useCache) LI << "  hits=" << cache.hits << " misses=" << cache.misses << " hitRate=" << renderPercent((double)cache.hits / (cache.hits + cache.misses));
+    }
+
+    std::vector<std::string> pubkeys;
+
+    {
+        flat_hash_set<std::string> seen;
+        for (const auto &s : sigs) {
+            if (seen.insert(s.pubkey).second) pubkeys.push_back(s.pubkey);
+        }
+    }
+
+    if (pubkeys.empty()) return;
+
+    LI << "Drawing " << numLookups << " lookups from " << pubkeys.size() << " distinct pubkeys, zipf=" << zipf;
+
+    std::vector<double> weights;
+    for (size_t i = 0; i < pubkeys.size(); i++) weights.push_back(1.0 / std::pow((double)(i + 1), zipf));
+
+    std::mt19937_64 rng(0);
+    std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+
+    std::vector<uint32_t> lookups;
+    for (uint64_t i = 0; i < numLookups; i++) lookups.push_back(dist(rng));
+
+    for (bool useCache : { false, true }) {
+        XOnlyPubkeyCache cache(cacheSize);
+        secp256k1_xonly_pubkey parsed;
+        uint64_t start = hoytech::curr_time_us();
+
+        for (auto i : lookups) {
+            if (useCache) cache.parse(secpCtx, &parsed, pubkeys[i]);
+            else secp256k1_xonly_pubkey_parse(secpCtx, &parsed, (const uint8_t*)pubkeys[i].data());
+        }
+
+        reportRate(useCache ? "pubkey parse, with cache" : "pubkey parse, no cache", lookups.size(), 0, hoytech::curr_time_us() - start);
+        if (useCache) LI << "  hits=" << cache.hits << " misses=" << cache.misses << " hitRate=" << renderPercent((double)cache.hits / (cache.hits + cache.misses));
+    }
+
+    secp256k1_context_destroy(secpCtx);
+}
+
+
+// Writes the events in batches of batchSize, one txn per batch like the relay writer, under each durability
+// mode. The events are deleted again after each pass, so every pass starts from an empty DB
+
+static void benchWrite(const std::vector<std::string> &lines, uint64_t iterations, const std::vector<WriterDurability> &modes, uint64_t batchSize, uint64_t syncIntervalMs) {
+    {
+        auto txn = env.txn_ro();
+        bool eventFound = false;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            eventFound = true;
+            return false;
+        });
+
+        if (eventFound) throw herr("bench write needs an empty DB: use --config to point at a scratch one");
+    }
+
+    std::vector<std::pair<std::string, std::string>> events; // flatStr, jsonStr
+    uint64_t totalBytes = 0;
+
+    {
+        EventParser parser;
+
+        for (const auto &l : lines) {
+            std::string flatStr, jsonStr;
+
+            try {
+                if (!parser.tryParse(l)) continue;
+                parseAndVerifyEvent(parser, nullptr, false, false, flatStr, jsonStr);
+            } catch (std::exception &) {
+                continue;
+            }
+
+            totalBytes += jsonStr.size();
+            events.emplace_back(std::move(flatStr), std::move(jsonStr));
+        }
+    }
+
+    LI << "Writing " << events.size() << " events in batches of " << batchSize;
+
+    for (auto mode : modes) {
+        env.lmdb_env.set_flags(MDB_NOSYNC | MDB_NOMETASYNC, false);
+        if (auto flags = writerDurabilityEnvFlags(mode)) env.lmdb_env.set_flags(flags, true);
+
+        uint64_t elapsed = 0, finalSyncElapsed = 0, numSyncs = 0;
+
+        for (uint64_t i = 0; i < iterations; i++) {
+            std::vector<std::vector<EventToWrite>> batches;
+
+            for (size_t j = 0; j < events.size(); j++) {
+                if (j % batchSize == 0) batches.emplace_back();
+                batches.back().emplace_back(events[j].first, events[j].second, hoytech::curr_time_us(), EventSourceType::Import, "");
+            }
+
+            std::atomic<bool> done = false;
+            std::thread syncThread;
+
+            if (mode == WriterDurability::Periodic) {
+                syncThread = std::thread([&]{
+                    auto next = std::chrono::steady_clock::now();
+
+                    while (!done) {
+                        next += std::chrono::milliseconds(syncIntervalMs);
+                        while (!done && std::chrono::steady_clock::now() < next) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        if (done) break;
+                        env.lmdb_env.sync(true);
+                        numSyncs++;
+                    }
+                });
+            }
+
+            uint64_t start = hoytech::curr_time_us();
+
+            for (auto &batch : batches) {
+                auto txn = env.txn_rw();
+                writeEvents(txn, batch, 0);
+                txn.commit();
+            }
+
+            elapsed += hoytech::curr_time_us() - start;
+
+            done = true;
+            if (syncThread.joinable()) syncThread.join();
+
+            // Time to make everything durable at the end of the pass: what a crash would otherwise lose
+
+            start = hoytech::curr_time_us();
+            env.lmdb_env.sync(true);
+            finalSyncElapsed += hoytech::curr_time_us() - start;
+
+            auto txn = env.txn_rw();
+            IndexStatsDelta statsDelta;
+
+            for (auto &batch : batches) {
+                for (auto &ev : batch) {
+                    if (ev.status == EventWriteStatus::Written) deleteEvent(txn, ev.levId, &statsDelta);
+                }
+            }
+
+            statsDelta.apply(txn);
+            txn.commit();
+        }
+
+        std::string desc = std::string("write, ") + writerDurabilityName(mode);
+        reportRate(desc.c_str(), events.size() * iterations, totalBytes * iterations, elapsed);
+        LI << "  final sync=" << (finalSyncElapsed / iterations) << "us/pass" << (mode == WriterDurability::Periodic ? " backgroundSyncs=" + std::to_string(numSyncs) : "");
+    }
+
+    env.lmdb_env.set_flags(MDB_NOSYNC | MDB_NOMETASYNC, false);
+    env.lmdb_env.sync(true);
+}
+
+
+// Per-key cost of matching index keys in DBScan's key cursors, over synthetic keys for each index. Most keys have the
+// cursor's prefix, as when a cursor walks its own range. The std::function matchers are the ones ScanCursor used to
+// store, for comparison with the ScanCursor::keyMatch specialisations
+
+template<DBScan::IndexPlan P>
+static void benchKeyMatchIndex(const char *desc, const DBScan::ScanCursor &cursor, std::function<DBScan::KeyMatchResult(std::string_view)> genericMatch, std::mt19937_64 &rng, uint64_t numKeys, uint64_t iterations) {
+    std::vector<std::string> keys;
+    keys.reserve(numKeys);
+
+    for (uint64_t i = 0; i < numKeys; i++) {
+        std::string prefix = cursor.keyPrefix;
+        if (rng() % 10 == 0) for (auto &c : prefix) c = (char)rng(); // a neighbouring prefix
+        uint64_t created = rng() % 2'000'000'000;
+        keys.emplace_back(prefix + std::string(lmdb::to_sv<uint64_t>(created)));
+    }
+
+    uint64_t genericMatches = 0, specialisedMatches = 0;
+
+    uint64_t start = hoytech::curr_time_us();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (const auto &k : keys) {
+            if (genericMatch(k) == DBScan::KeyMatchResult::Yes) genericMatches++;
+        }
+    }
+
+    uint64_t genericElapsed = hoytech::curr_time_us() - start;
+    start = hoytech::curr_time_us();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (const auto &k : keys) {
+            if (cursor.keyMatch<P>(k) == DBScan::KeyMatchResult::Yes) specialisedMatches++;
+        }
+    }
+
+    uint64_t specialisedElapsed = hoytech::curr_time_us() - start;
+
+    if (genericMatches != specialisedMatches) throw herr("key matchers disagree for ", desc, ": ", genericMatches, " vs ", specialisedMatches);
+
+    auto nsPerKey = [&](uint64_t elapsedUs){ return (double)elapsedUs * 1000 / std::max(numKeys * iterations, uint64_t(1)); };
+
+    LI << desc << ": std::function=" << nsPerKey(genericElapsed) << "ns/key specialised=" << nsPerKey(specialisedElapsed) << "ns/key"
+       << " (" << genericMatches / std::max(iterations, uint64_t(1)) << "/" << numKeys << " matched)";
+}
+
+static void benchKeyMatch(uint64_t iterations, uint64_t numKeys) {
+    using Plan = DBScan::IndexPlan;
+    using Result = DBScan::KeyMatchResult;
+
+    std::mt19937_64 rng(0);
+
+    auto randBytes = [&](size_t n){
+        std::string output;
+        for (size_t i = 0; i < n; i++) output += (char)rng();
+        return output;
+    };
+
+    auto startsWith = [](std::string prefix){
+        return [prefix](std::string_view k){ return k.starts_with(prefix) ? Result::Yes : Result::No; };
+    };
+
+    {
+        DBScan::ScanCursor cursor("", 0, randBytes(32));
+        benchKeyMatchIndex<Plan::Id>("Id", cursor, startsWith(cursor.keyPrefix), rng, numKeys, iterations);
+    }
+
+    {
+        std::string search = std::string("e") + randBytes(32);
+        DBScan::ScanCursor cursor("", 0, search);
+        benchKeyMatchIndex<Plan::Tag>("Tag", cursor, [search](std::string_view k){
+            return k.size() == search.size() + 8 && k.starts_with(search) ? Result::Yes : Result::No;
+        }, rng, numKeys, iterations);
+    }
+
+    {
+        uint64_t kind = 1;
+        DBScan::ScanCursor cursor("", 0, randBytes(32) + std::string(lmdb::to_sv<uint64_t>(kind)), kind);
+        benchKeyMatchIndex<Plan::PubkeyKind>("PubkeyKind", cursor, startsWith(cursor.keyPrefix), rng, numKeys, iterations);
+    }
+
+    {
+        DBScan::ScanCursor cursor("", 0, randBytes(32));
+        benchKeyMatchIndex<Plan::Pubkey>("Pubkey", cursor, startsWith(cursor.keyPrefix), rng, numKeys, iterations);
+    }
+
+    {
+        uint64_t kind = 7;
+        DBScan::ScanCursor cursor("", 0, std::string(lmdb::to_sv<uint64_t>(kind)));
+        benchKeyMatchIndex<Plan::Kind>("Kind", cursor, [kind](std::string_view k){
+            ParsedKey_Uint64Uint64 parsedKey(k);
+            return parsedKey.n1 == kind ? Result::Yes : Result::No;
+        }, rng, numKeys, iterations);
+    }
+}
+
+
+// Merging the candidates of many scan cursors into one (created_at, levId) descending stream, as DBScan::scan does.
+// Cursors are synthetic lists of candidates, collected initialDepth at a time and then refillDepth at a time whenever
+// a cursor runs out, like ScanCursor::collect. The previous approach kept one sorted std::deque of every cursor's
+// candidates and std::merge'd each refill into it; this is compared with DBScan::CandidateMerger
+
+static void benchMerge(uint64_t iterations, const std::vector<uint64_t> &cursorCounts, uint64_t numCandidates) {
+    std::mt19937_64 rng(0);
+
+    for (auto numCursors : cursorCounts) {
+        if (numCursors == 0) continue;
+
+        std::vector<std::vector<DBScan::CandidateEvent>> sources(numCursors);
+        uint64_t perCursor = std::max(numCandidates / numCursors, uint64_t(1));
+        uint64_t nextLevId = 1;
+
+        for (uint64_t i = 0; i < numCursors; i++) {
+            std::vector<uint64_t> created;
+            for (uint64_t j = 0; j < perCursor; j++) created.push_back(rng() % 2'000'000'000);
+            std::sort(created.begin(), created.end(), std::greater<>());
+            for (auto c : created) sources[i].emplace_back(nextLevId++, c, i);
+        }
+
+        uint64_t initialDepth = numCursors > 1'000 ? 1 : 5;
+        uint64_t refillDepth = 10 * initialDepth;
+
+        std::vector<uint64_t> dequeOrder, mergerOrder;
+
+        auto run = [&](auto &&impl, std::vector<uint64_t> &order){
+            uint64_t start = hoytech::curr_time_us();
+
+            for (uint64_t iter = 0; iter < iterations; iter++) {
+                order.clear();
+                std::vector<uint64_t> pos(numCursors, 0);
+
+                auto collect = [&](uint64_t i, uint64_t depth, auto &&add){
+                    uint64_t n = std::min(depth, sources[i].size() - pos[i]);
+                    for (uint64_t j = 0; j < n; j++) add(sources[i][pos[i]++]);
+                    return n;
+                };
+
+                impl(collect, order);
+            }
+
+            return hoytech::curr_time_us() - start;
+        };
+
+        auto cmp = [](const DBScan::CandidateEvent &a, const DBScan::CandidateEvent &b){
+            return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
+        };
+
+        uint64_t dequeElapsed = run([&](auto &collect, std::vector<uint64_t> &order){
+            std::deque<DBScan::CandidateEvent> eventQueue;
+            std::vector<uint64_t> outstanding(numCursors);
+
+            for (uint64_t i = 0; i < numCursors; i++) {
+                outstanding[i] = collect(i, initialDepth, [&](auto ev){ eventQueue.push_back(ev); });
+            }
+
+            std::sort(eventQueue.begin(), eventQueue.end(), cmp);
+
+            while (eventQueue.size()) {
+                auto ev = eventQueue.front();
+                eventQueue.pop_front();
+                order.push_back(ev.levId());
+
+                if (--outstanding[ev.scanIndex()] == 0) {
+                    std::deque<DBScan::CandidateEvent> moreEvents, newEventQueue;
+                    outstanding[ev.scanIndex()] = collect(ev.scanIndex(), refillDepth, [&](auto ev){ moreEvents.push_back(ev); });
+                    std::merge(eventQueue.begin(), eventQueue.end(), moreEvents.begin(), moreEvents.end(), std::back_inserter(newEventQueue), cmp);
+                    eventQueue.swap(newEventQueue);
+                }
+            }
+        }, dequeOrder);
+
+        uint64_t mergerElapsed = run([&](auto &collect, std::vector<uint64_t> &order){
+            DBScan::CandidateMerger merger;
+            merger.init(false, initialDepth, refillDepth, numCursors);
+
+            auto fill = [&](uint64_t i, uint64_t depth){
+                auto *output = merger.fillStart(i, depth);
+                uint64_t n = collect(i, depth, [&](auto ev){ *output++ = ev; });
+                merger.filled(i, n);
+            };
+
+            for (uint64_t i = 0; i < numCursors; i++) fill(i, initialDepth);
+
+            while (!merger.empty()) {
+                auto ev = merger.pop();
+                order.push_back(ev.levId());
+                if (merger.remaining(ev.scanIndex()) == 0) fill(ev.scanIndex(), refillDepth);
+            }
+        }, mergerOrder);
+
+        if (dequeOrder != mergerOrder) throw herr("CandidateMerger order differs from std::merge for ", numCursors, " cursors");
+
+        uint64_t total = dequeOrder.size() * iterations;
+        std::string desc = std::to_string(numCursors) + " cursors";
+        reportRate((desc + ", deque + std::merge").c_str(), total, 0, dequeElapsed);
+        reportRate((desc + ", CandidateMerger").c_str(), total, 0, mergerElapsed);
+    }
+}
+
+
+void cmd_bench(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    uint64_t iterations = 10;
+    if (args["--iterations"]) iterations = args["--iterations"].asLong();
+
+    if (args["parse"].asBool()) {
+        auto lines = readLines();
+        benchParse(lines, iterations);
+    } else if (args["verify"].asBool()) {
+        std::vector<uint64_t> batchSizes;
+
+        {
+            std::string batchSizesStr = args["--batch-sizes"] ? args["--batch-sizes"].asString() : "1,8,32,128";
+            std::stringstream ss(batchSizesStr);
+            std::string item;
+            while (std::getline(ss, item, ',')) batchSizes.push_back(parseUint64(item));
+        }
+
+        auto lines = readLines();
+        auto sigs = loadSigs(lines);
+        benchVerify(sigs, iterations, batchSizes);
+    } else if (args["sha256"].asBool()) {
+        auto lines = readLines();
+        benchSha256(lines, iterations);
+    } else if (args["flat"].asBool()) {
+        auto lines = readLines();
+        benchFlat(lines, iterations, args["--count-allocs"].asBool());
+    } else if (args["pubkeys"].asBool()) {
+        uint64_t cacheSize = args["--cache-size"] ? parseUint64(args["--cache-size"].asString()) : 8192;
+        double zipf = args["--zipf"] ? std::stod(args["--zipf"].asString()) : 1.1;
+        uint64_t numLookups = args["--lookups"] ? parseUint64(args["--lookups"].asString()) : 1'000'000;
+
+        auto lines = readLines();
+        auto sigs = loadSigs(lines);
+        benchPubkeys(sigs, iterations, cacheSize, zipf, numLookups);
+    } else if (args["write"].asBool()) {
+        std::vector<WriterDurability> modes;
+
+        {
+            std::string modesStr = args["--modes"] ? args["--modes"].asString() : "sync,periodic,async";
+            std::stringstream ss(modesStr);
+            std::string item;
+            while (std::getline(ss, item, ',')) modes.push_back(parseWriterDurability(item));
+        }
+
+        uint64_t batchSize = std::max(args["--batch-size"] ? parseUint64(args["--batch-size"].asString()) : 100, (uint64_t)1);
+        uint64_t syncIntervalMs = args["--sync-interval"] ? parseUint64(args["--sync-interval"].asString()) : 1000;
+
+        auto lines = readLines();
+        benchWrite(lines, iterations, modes, batchSize, syncIntervalMs);
+    } else if (args["keymatch"].asBool()) {
+        uint64_t numKeys = args["--keys"] ? parseUint64(args["--keys"].asString()) : 1'000'000;
+        benchKeyMatch(iterations, numKeys);
+    } else if (args["merge"].asBool()) {
+        std::vector<uint64_t> cursorCounts;
+
+        {
+            std::string cursorsStr = args["--cursors"] ? args["--cursors"].asString() : "1,100,5000";
+            std::stringstream ss(cursorsStr);
+            std::string item;
+            while (std::getline(ss, item, ',')) cursorCounts.push_back(parseUint64(item));
+        }
+
+        uint64_t numCandidates = args["--candidates"] ? parseUint64(args["--candidates"].asString()) : 1'000'000;
+        benchMerge(iterations, cursorCounts, numCandidates);
+    }
+}
@@ -68,11 +68,13 @@ void cmd_delete(const std::vector<std::string> &subArgs) {
 
     {
         auto txn = env.txn_rw();
+        IndexStatsDelta statsDelta;
 
         for (auto levId : levIds) {
-            deleteEvent(txn, levId);
+            deleteEvent(txn, levId, &statsDelta);
         }
 
+        statsDelta.apply(txn);
         txn.commit();
     }
 }
@@ -5,6 +5,7 @@
 
 #include "events.h"
 #include "filters.h"
+#include "EventBatchVerifier.h"
 
 
 static const char USAGE[] =
@@ -25,16 +26,44 @@ void cmd_import(const std::vector<std::string> &subArgs) {
     auto txn = env.txn_rw();
 
     secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+    EventParser eventParser;
+    EventBatchVerifier verifier;
 
     std::string line;
     uint64_t processed = 0, added = 0, rejected = 0, dups = 0;
     std::vector<EventToWrite> newEvents;
+    std::vector<EventToWrite> pendingEvents; // parallel to verifier.items
+    std::vector<uint64_t> pendingLineNums;
 
     auto logStatus = [&]{
         LI << "Processed " << processed << " lines. " << added << " added, " << rejected << " rejected, " << dups << " dups";
     };
 
+    // Ids and signatures are checked in batches, see EventBatchVerifier
+
+    auto verifyPending = [&]{
+        verifier.verify(secpCtx);
+
+        for (size_t i = 0; i < pendingEvents.size(); i++) {
+            auto &error = verifier.items[i].error;
+
+            if (error.size()) {
+                if (showRejected) LW << "Line " << pendingLineNums[i] << " rejected: " << error;
+                rejected++;
+                continue;
+            }
+
+            newEvents.emplace_back(std::move(pendingEvents[i]));
+        }
+
+        verifier.clear();
+        pendingEvents.clear();
+        pendingLineNums.clear();
+    };
+
     auto flushChanges = [&]{
+        verifyPending();
+
         writeEvents(txn, newEvents, 0);
 
         uint64_t numCommits = 0;
@@ -68,17 +97,32 @@ void cmd_import(const std::vector<std::string> &subArgs) {
 
         std::string flatStr;
         std::string jsonStr;
+        DeferredEventChecks checks;
+        DeferredEventChecks *checksPtr = noVerify ? nullptr : &checks;
 
         try {
-            auto origJson = tao::json::from_string(line);
-            parseAndVerifyEvent(origJson, secpCtx, !noVerify, false, flatStr, jsonStr);
+            if (eventParser.tryParse(line)) {
+                parseAndVerifyEvent(eventParser, secpCtx, !noVerify, false, flatStr, jsonStr, checksPtr);
+            } else {
+                auto origJson = tao::json::from_string(line);
+                parseAndVerifyEvent(origJson, secpCtx, !noVerify, false, flatStr, jsonStr, checksPtr);
+            }
         } catch (std::exception &e) {
             if (showRejected) LW << "Line " << processed << " rejected: " << e.what();
             rejected++;
             continue;
         }
 
-        newEvents.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), EventSourceType::Import, "");
+        if (noVerify) {
+            newEvents.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), EventSourceType::Import, "");
+        } else {
+            auto *flat = flatStrToFlatEvent(flatStr);
+            verifier.add(std::move(checks), sv(flat->id()), sv(flat->pubkey()));
+            pendingEvents.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), EventSourceType::Import, "");
+            pendingLineNums.push_back(processed);
+
+            if (pendingEvents.size() >= 1'000) verifyPending();
+        }
 
         if (newEvents.size() >= 10'000) flushChanges();
     }
@@ -0,0 +1,166 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "QueryScheduler.h"
+#include "ReqResultCache.h"
+#include "events.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      reqworker [--pause=<pause>] [--share-scans] [--share-lag=<share-lag>] [--cache-entries=<cache-entries>]
+
+    Options:
+      --pause=<pause>                  Timeslice budget in microseconds [default: 1]
+      --share-scans                    Subscriptions with identical filters join queries that are still scanning
+      --share-lag=<share-lag>          How many events can have been written since a shared scan began for it to be joined [default: 0]
+      --cache-entries=<cache-entries>  Size of the REQ result cache, like relay.reqWorker.cacheMaxEntries (its other limits are taken from the config) [default: 0]
+)";
+
+
+// Runs subscriptions through a QueryScheduler like a ReqWorker thread does, one command per line on stdin. Each
+// command gets a new read txn, so events can be imported in between. What each subscription is sent is printed
+// as it happens, with events as their ids:
+//
+//     printf '["sub",1,"a",{"kinds":[1]}]\n["run"]\n' | ./strfry reqworker
+//
+//     ["EVENT",1,"a","<id>"]
+//     ["EOSE",1,"a"]
+//
+// Commands:
+//     ["sub", connId, subId, filters]    Add a subscription (filters are not limited by relay.maxFilterLimit)
+//     ["removeSub", connId, subId]
+//     ["closeConn", connId]
+//     ["process"]                        Run one timeslice
+//     ["run"]                            Run timeslices until no queries are waiting
+//     ["away", connId, subId]            Run timeslices until the subscription's query pauses while others are waiting,
+//                                        and hand it off as if to another ReqWorker thread
+//     ["runAway"]                        Run one timeslice of each query that was handed off, and return them
+//     ["stats"]                          Print the result cache's counters as ["STATS", {...}]
+//
+// When a subscription joins a shared scan, ["SHARED", connId, subId] is printed after its catch-up events.
+
+void cmd_reqworker(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    QueryScheduler queries;
+
+    queries.timesliceBudgetMicroseconds = std::max(args["--pause"].asLong(), 1L);
+    queries.shareScans = args["--share-scans"].asBool();
+    queries.maxShareLevIdLag = args["--share-lag"].asLong();
+
+    ReqResultCache cache;
+    uint64_t cacheMaxEntries = args["--cache-entries"].asLong();
+    queries.recordSent = cacheMaxEntries > 0;
+
+    Decompressor decomp;
+
+    auto output = [](tao::json::value msg){
+        std::cout << tao::json::to_string(msg) << std::endl;
+    };
+
+    queries.onEvent = [&](lmdb::txn &txn, const auto &sub, uint64_t levId, std::string_view){
+        auto ev = lookupEventByLevId(txn, levId);
+        output(tao::json::value::array({ "EVENT", sub.connId, sub.subId.str(), to_hex(sv(ev.flat_nested()->id())) }));
+    };
+
+    queries.onShared = [&](const auto &sub, DBQuery &){
+        output(tao::json::value::array({ "SHARED", sub.connId, sub.subId.str() }));
+    };
+
+    queries.onQueryComplete = [&](DBQuery &q){
+        if (queries.recordSent && q.sentInOrder.size() <= cfg().relay__reqWorker__cacheMaxResultSize && ReqResultCache::cacheable(q.sub.filterGroup)) {
+            cache.add(tao::json::to_string(q.sub.filterGroup.toJson()), q.sentInOrder, q.sub.latestEventId, cacheMaxEntries, cfg().relay__reqWorker__cacheMaxBytes);
+        }
+    };
+
+    queries.onComplete = [&](Subscription &sub){
+        output(tao::json::value::array({ "EOSE", sub.connId, sub.subId.str() }));
+    };
+
+    DBQuery *handOff = nullptr;
+    std::vector<DBQuery*> awayQueries;
+
+    queries.onPaused = [&](DBQuery *q){
+        if (q != handOff) return false;
+
+        awayQueries.push_back(q);
+        handOff = nullptr;
+        return true;
+    };
+
+    auto serveFromCache = [&](lmdb::txn &txn, Subscription &sub){
+        std::vector<std::string_view> eventPayloads;
+        uint64_t latestEventId;
+
+        if (!cache.lookup(txn, tao::json::to_string(sub.filterGroup.toJson()), sub.filterGroup, cfg().relay__reqWorker__cacheMaxLevIdLag,
+                          eventPayloads, latestEventId)) {
+            return false;
+        }
+
+        queries.removeSub(sub.connId, sub.subId);
+
+        for (auto eventPayload : eventPayloads) {
+            auto ev = tao::json::from_string(decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
+            output(tao::json::value::array({ "EVENT", sub.connId, sub.subId.str(), ev.at("id").get_string() }));
+        }
+
+        sub.latestEventId = latestEventId;
+        queries.onComplete(sub);
+
+        return true;
+    };
+
+    std::string line;
+
+    while (std::getline(std::cin, line)) {
+        if (!line.size()) continue;
+
+        auto msg = tao::json::from_string(line);
+        auto &msgArr = msg.get_array();
+
+        auto cmd = msgArr.at(0).get_string();
+
+        auto txn = env.txn_ro();
+
+        if (cmd == "sub") {
+            Subscription sub(msgArr.at(1).get_unsigned(), msgArr.at(2).get_string(), NostrFilterGroup::unwrapped(msgArr.at(3), MAX_U64));
+            if (queries.recordSent && ReqResultCache::cacheable(sub.filterGroup) && serveFromCache(txn, sub)) continue;
+            if (!queries.addSub(txn, std::move(sub))) throw herr("too many concurrent REQs");
+        } else if (cmd == "removeSub") {
+            queries.removeSub(msgArr.at(1).get_unsigned(), SubId(msgArr.at(2).get_string()));
+        } else if (cmd == "closeConn") {
+            queries.closeConn(msgArr.at(1).get_unsigned());
+        } else if (cmd == "process") {
+            queries.process(txn);
+        } else if (cmd == "run") {
+            while (!queries.running.empty()) queries.process(txn);
+        } else if (cmd == "away") {
+            handOff = queries.findQuery(msgArr.at(1).get_unsigned(), SubId(msgArr.at(2).get_string()));
+            if (!handOff) throw herr("no such subscription");
+
+            while (handOff && !queries.running.empty()) queries.process(txn);
+            if (handOff) throw herr("query wasn't handed off");
+        } else if (cmd == "runAway") {
+            for (auto *q : awayQueries) {
+                bool complete = queries.processTimeslice(txn, q);
+                queries.returnQuery(q, complete);
+            }
+
+            awayQueries.clear();
+        } else if (cmd == "stats") {
+            output(tao::json::value::array({ "STATS", tao::json::value({
+                { "hits", cache.hits.load() },
+                { "misses", cache.misses.load() },
+                { "extensions", cache.extensions.load() },
+                { "invalidations", cache.invalidations.load() },
+                { "entries", cache.numEntries.load() },
+            }) }));
+        } else {
+            throw herr("unknown cmd");
+        }
+    }
+}
@@ -10,7 +10,16 @@
 static const char USAGE[] =
 R"(
     Usage:
-      scan [--pause=<pause>] [--metrics] [--count] <filter>
+      scan [--pause=<pause>] [--metrics] [--count] [--explain] [--analyze] [--ascending] [--paged] <filter>
+
+    Options:
+      --ascending Return the oldest matching events first (same as "order": "asc" in the filters)
+      --explain   Print the index and cursors each filter would use, without scanning
+      --analyze   Scan, and print the plan along with what each filter's scan did instead of the events
+      --paged     Return a continuation token for each filter (same as "cursor": "" in the filters that don't have one)
+
+    When any filter has a "cursor" item, its scan continues from that token, and once the events have been printed, a
+    final line ["EOSE", [<token>, ...]] has a token for the next page of each filter, or null if it has no more results.
 )";
 
 
@@ -22,21 +31,59 @@ void cmd_scan(const std::vector<std::string> &subArgs) {
 
     bool metrics = args["--metrics"].asBool();
     bool count = args["--count"].asBool();
+    bool explain = args["--explain"].asBool();
+    bool analyze = args["--analyze"].asBool();
+    bool ascending = args["--ascending"].asBool();
+    bool paged = args["--paged"].asBool();
 
-    std::string filterStr = args["<filter>"].asString();
+    auto filter = tao::json::from_string(args["<filter>"].asString());
+    if (!filter.is_array()) filter = tao::json::value::array({ filter });
 
+    // Added to the JSON rather than set on the parsed filters, since they're part of what continuation tokens identify
+
+    for (auto &f : filter.get_array()) {
+        if (ascending) f["order"] = "asc";
+        if (paged && !f.find("cursor")) f["cursor"] = "";
+    }
 
-    DBQuery query(tao::json::from_string(filterStr));
+
+    DBQuery query(filter);
 
     Decompressor decomp;
 
     auto txn = env.txn_ro();
 
+    if (explain) {
+        const auto &filters = query.sub.filterGroup.filters;
+
+        for (size_t i = 0; i < filters.size(); i++) {
+            DBScan scanner(txn, filters[i]);
+            auto plan = scanner.explain();
+            plan["filter"] = i;
+            std::cout << tao::json::to_string(plan, 2) << "\n";
+        }
+
+        return;
+    }
+
+    if (analyze) {
+        query.analyze = true;
+
+        query.onScanComplete = [&](DBScan &scanner){
+            auto plan = scanner.explain();
+            plan["filter"] = query.filterGroupIndex;
+            plan["timeUs"] = query.currScanTime;
+            plan["saveRestores"] = query.currScanSaveRestores;
+            plan["recsFound"] = query.sentEventsCurr.size();
+            std::cout << tao::json::to_string(plan, 2) << "\n";
+        };
+    }
+
     uint64_t numEvents = 0;
 
     while (1) {
         bool complete = query.process(txn, [&](const auto &sub, uint64_t levId, std::string_view eventPayload){
-            if (count) numEvents++;
+            if (count || analyze) numEvents++;
             else std::cout << getEventJson(txn, decomp, levId, eventPayload) << "\n";
         }, pause ? pause : MAX_U64, metrics);
 
@@ -44,4 +91,10 @@ void cmd_scan(const std::vector<std::string> &subArgs) {
     }
 
     if (count) std::cout << numEvents << std::endl;
+
+    if (query.sub.filterGroup.wantsContinuation()) {
+        tao::json::value tokens = tao::json::empty_array;
+        for (const auto &c : query.continuations) tokens.push_back(c ? tao::json::value(*c) : tao::json::null);
+        std::cout << tao::json::to_string(tao::json::value::array({ "EOSE", std::move(tokens) })) << std::endl;
+    }
 }
@@ -0,0 +1,97 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "events.h"
+#include "IndexStats.h"
+#include "EventCover.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      stats [--rebuild] [--chunk-size=<chunk-size>]
+
+    Options:
+      --rebuild                    Recount the index stats, and rebuild the event cover values, from every event in the DB
+      --chunk-size=<chunk-size>    Number of events recounted per write transaction [default: 10000]
+)";
+
+
+void cmd_stats(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    if (args["--rebuild"].asBool()) {
+        uint64_t chunkSize = std::max(args["--chunk-size"].asLong(), 1L);
+
+        // The stats are cleared first, and then recounted over the events that existed at that point, one chunk
+        // of levIds per txn, so a running relay's writer is only blocked briefly. Events written in the meantime
+        // are counted by the writer itself. The complete flag is only set by the last chunk, so until then DBScan
+        // doesn't rely on the partial counts.
+
+        uint64_t endLevId;
+
+        {
+            auto txn = env.txn_rw();
+            IndexStats::clear(txn);
+            endLevId = getMostRecentLevId(txn);
+            txn.commit();
+        }
+
+        uint64_t nextLevId = 1;
+        uint64_t numEvents = 0;
+
+        while (1) {
+            auto txn = env.txn_rw();
+            IndexStatsDelta delta;
+            uint64_t numInChunk = 0;
+            bool done = true;
+
+            env.foreach_Event(txn, [&](auto &ev){
+                if (ev.primaryKeyId > endLevId) return false;
+
+                if (numInChunk == chunkSize) {
+                    nextLevId = ev.primaryKeyId;
+                    done = false;
+                    return false;
+                }
+
+                delta.add(ev.flat_nested(), 1);
+                EventCover::put(txn, ev.primaryKeyId, ev.flat_nested()); // not MDB_APPEND: the writer may have added later levIds
+                numInChunk++;
+                return true;
+            }, false, nextLevId);
+
+            delta.apply(txn);
+            if (done) IndexStats::markComplete(txn);
+            txn.commit();
+
+            numEvents += numInChunk;
+            if (done) break;
+        }
+
+        LI << "Rebuilt index stats and event cover values for " << numEvents << " events";
+    }
+
+    auto txn = env.txn_ro();
+    IndexStats stats(txn);
+
+    std::cout << "Complete: " << (stats.complete ? "yes" : "no") << "\n";
+    std::cout << "Events: " << stats.total() << "\n";
+    std::cout << "Events with cover values: " << env.dbi_EventCover.size(txn) << "\n";
+
+    std::vector<std::pair<uint64_t, uint64_t>> kinds; // count, kind
+    auto cursor = lmdb::cursor::open(txn, env.dbi_IndexStats);
+    std::string_view k = "K", v;
+
+    for (bool found = cursor.get(k, v, MDB_SET_RANGE); found && k.starts_with("K"); found = cursor.get(k, v, MDB_NEXT)) {
+        kinds.emplace_back(lmdb::from_sv<uint64_t>(v), lmdb::from_sv<uint64_t>(k.substr(1)));
+    }
+
+    std::sort(kinds.begin(), kinds.end(), std::greater<>());
+    if (kinds.size() > 20) kinds.resize(20);
+
+    std::cout << "Top kinds:\n";
+    for (const auto &[count, kind] : kinds) std::cout << "  " << kind << ": " << count << "\n";
+}
@@ -55,11 +55,13 @@ void RelayServer::runCron() {
             auto txn = env.txn_rw();
 
             uint64_t numDeleted = 0;
+            IndexStatsDelta statsDelta;
 
             for (auto levId : expiredLevIds) {
-                if (deleteEvent(txn, levId)) numDeleted++;
+                if (deleteEvent(txn, levId, &statsDelta)) numDeleted++;
             }
 
+            statsDelta.apply(txn);
             txn.commit();
 
             if (numDeleted) LI << "Deleted " << numDeleted << " ephemeral events";
@@ -109,11 +111,13 @@ void RelayServer::runCron() {
             auto txn = env.txn_rw();
 
             uint64_t numDeleted = 0;
+            IndexStatsDelta statsDelta;
 
             for (auto levId : expiredLevIds) {
-                if (deleteEvent(txn, levId)) numDeleted++;
+                if (deleteEvent(txn, levId, &statsDelta)) numDeleted++;
             }
 
+            statsDelta.apply(txn);
             txn.commit();
 
             if (numDeleted) LI << "Deleted " << numDeleted << " events (ephemeral=" << numEphemeral << " expired=" << numExpired << ")";
@@ -121,8 +125,117 @@ void RelayServer::runCron() {
     });
 
 
+    // Log performance counters
+
+    if (cfg().relay__logging__statsIntervalSeconds) {
+        cron.repeat(cfg().relay__logging__statsIntervalSeconds * 1'000'000UL, [&]{
+            logStats();
+        });
+    }
+
 
     cron.run();
 
     while (1) std::this_thread::sleep_for(std::chrono::seconds(1'000'000));
 }
+
+
+void RelayServer::logStats() {
+    {
+        uint64_t verified = ingesterStats.verified;
+        uint64_t dupsStored = ingesterStats.dupsStored;
+        uint64_t dupsInFlight = ingesterStats.dupsInFlight;
+        uint64_t dupsVerified = ingesterStats.dupsVerified;
+        uint64_t skipped = dupsStored + dupsInFlight;
+
+        if (verified + skipped > 0) {
+            LI << "Ingester stats: verified=" << verified
+               << " dupsSkipped=" << skipped << " (stored=" << dupsStored << " inFlight=" << dupsInFlight << ")"
+               << " dupsVerified=" << dupsVerified
+               << " verificationsAvoided=" << renderPercent((double)skipped / (verified + skipped));
+        }
+
+        uint64_t sigBatchVerifies = ingesterStats.sigBatchVerifies;
+        uint64_t sigSingleVerifies = ingesterStats.sigSingleVerifies;
+
+        if (sigBatchVerifies + sigSingleVerifies > 0) {
+            LI << "Ingester sig batches: batchVerifies=" << sigBatchVerifies << " singleVerifies=" << sigSingleVerifies;
+        }
+
+        uint64_t pubkeyCacheHits = ingesterStats.pubkeyCacheHits;
+        uint64_t pubkeyCacheMisses = ingesterStats.pubkeyCacheMisses;
+
+        if (pubkeyCacheHits + pubkeyCacheMisses > 0) {
+            LI << "Ingester pubkey cache: hits=" << pubkeyCacheHits << " misses=" << pubkeyCacheMisses
+               << " hitRate=" << renderPercent((double)pubkeyCacheHits / (pubkeyCacheHits + pubkeyCacheMisses));
+        }
+    }
+
+    if (writerStats.batchSize.count) {
+        LI << "Writer batch sizes: " << writerStats.batchSize.render();
+        LI << "Writer commit latency (us): " << writerStats.commitLatencyUs.render();
+
+        uint64_t committedLevId = writerStats.committedLevId;
+        uint64_t durableLevId = writerStats.durableLevId;
+
+        if (durableLevId) {
+            LI << "Writer watermarks: committed=" << committedLevId << " durable=" << durableLevId
+               << " (" << (committedLevId - durableLevId) << " behind)";
+        }
+    }
+
+    {
+        uint64_t reqs = reqWorkerStats.reqs;
+        uint64_t sharedScans = reqWorkerStats.sharedScans;
+
+        if (reqs > 0) {
+            LI << "ReqWorker stats: reqs=" << reqs << " sharedScans=" << sharedScans
+               << " scansAvoided=" << renderPercent((double)sharedScans / reqs);
+        }
+
+        uint64_t cacheHits = reqResultCache.hits;
+        uint64_t cacheMisses = reqResultCache.misses;
+
+        if (cacheHits + cacheMisses > 0) {
+            LI << "ReqWorker result cache: hits=" << cacheHits << " misses=" << cacheMisses
+               << " hitRate=" << renderPercent((double)cacheHits / (cacheHits + cacheMisses))
+               << " extensions=" << reqResultCache.extensions << " invalidations=" << reqResultCache.invalidations
+               << " entries=" << reqResultCache.numEntries << " bytes=" << reqResultCache.numBytes;
+        }
+    }
+
+    {
+        static uint64_t prevTime = 0; // busy time is reported from the second call on, since the first covers startup
+        static std::vector<uint64_t> prevBusyUs(reqWorkerStats.threads.size());
+        uint64_t now = hoytech::curr_time_us();
+
+        if (prevTime && now > prevTime) {
+            std::string utilization;
+            uint64_t slicesStolen = 0;
+
+            for (size_t i = 0; i < reqWorkerStats.threads.size(); i++) {
+                auto &t = reqWorkerStats.threads[i];
+
+                if (i) utilization += " ";
+                utilization += std::to_string(i) + "=" + renderPercent((double)(t.busyUs - prevBusyUs[i]) / (now - prevTime));
+                slicesStolen += t.slicesStolen;
+            }
+
+            LI << "ReqWorker utilization: " << utilization << " slicesStolen=" << slicesStolen;
+        }
+
+        for (size_t i = 0; i < reqWorkerStats.threads.size(); i++) prevBusyUs[i] = reqWorkerStats.threads[i].busyUs;
+        prevTime = now;
+    }
+
+    {
+        static uint64_t prevRecorded = 0;
+        uint64_t numRecorded = slowQueryLog.numRecorded;
+
+        if (numRecorded != prevRecorded) {
+            LI << "Slow queries: " << (numRecorded - prevRecorded) << " new, " << numRecorded << " total. Slowest recent:";
+            for (const auto &r : slowQueryLog.slowest(3)) LI << "  " << r.json;
+            prevRecorded = numRecorded;
+        }
+    }
+}
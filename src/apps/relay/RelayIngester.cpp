@@ -4,6 +4,10 @@
 void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
     Decompressor decomp;
+    EventParser eventParser;
+    XOnlyPubkeyCache pubkeyCache(cfg().relay__pubkeyCacheSize);
+    IngesterVerifyBatch verifyBatch;
+    verifyBatch.verifier.sigVerifier.pubkeyCache = &pubkeyCache;
 
     while(1) {
         auto newMsgs = thr.inbox.pop_all();
@@ -11,11 +15,26 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
         auto txn = env.txn_ro();
 
         std::vector<MsgWriter> writerMsgs;
+        verifyBatch.verifier.sigVerifier.useBatch = cfg().relay__batchSigVerify;
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgIngester::ClientMessage>(&newMsg.msg)) {
                 try {
-                    if (msg->payload.starts_with('[')) {
+                    std::string_view eventJson;
+
+                    if (EventParser::unwrapEventMessage(msg->payload, eventJson) && eventParser.tryParse(eventJson)) {
+                        // Common case for EVENT messages, handled without building a JSON DOM
+
+                        if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
+                        if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
+
+                        try {
+                            ingesterProcessEvent(txn, msg->connId, msg->ipAddr, secpCtx, eventParser, verifyBatch);
+                        } catch (std::exception &e) {
+                            sendOKResponse(msg->connId, eventParser.id, false, std::string("invalid: ") + e.what());
+                            LI << "Rejected invalid event: " << e.what();
+                        }
+                    } else if (msg->payload.starts_with('[')) {
                         auto payload = tao::json::from_string(msg->payload);
 
                         if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
@@ -30,7 +49,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
 
                             try {
-                                ingesterProcessEvent(txn, msg->connId, msg->ipAddr, secpCtx, arr[1], writerMsgs);
+                                ingesterProcessEvent(txn, msg->connId, msg->ipAddr, secpCtx, arr[1], verifyBatch);
                             } catch (std::exception &e) {
                                 sendOKResponse(msg->connId, arr[1].at("id").get_string(), false, std::string("invalid: ") + e.what());
                                 LI << "Rejected invalid event: " << e.what();
@@ -39,7 +58,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             if (cfg().relay__logging__dumpInReqs) LI << "[" << msg->connId << "] dumpInReq: " << msg->payload; 
 
                             try {
-                                ingesterProcessReq(txn, msg->connId, arr);
+                                ingesterProcessReq(txn, msg->connId, msg->ipAddr, arr);
                             } catch (std::exception &e) {
                                 sendNoticeError(msg->connId, std::string("bad req: ") + e.what());
                             }
@@ -76,36 +95,141 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
             }
         }
 
+        if (verifyBatch.events.size()) {
+            ingesterVerifyBatch(secpCtx, verifyBatch, writerMsgs);
+        }
+
         if (writerMsgs.size()) {
             tpWriter.dispatchMulti(0, writerMsgs);
         }
     }
 }
 
-void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output) {
+// Decodes an event's id without verifying anything, so duplicates can be detected before doing any crypto.
+// Returns an empty string if the id is malformed: verification will report the error later.
+
+static std::string unverifiedEventId(std::string_view idHex) {
+    if (idHex.size() != 64) return "";
+
+    try {
+        return from_hex(idHex, false);
+    } catch (std::exception &) {
+        return "";
+    }
+}
+
+// Id and signature checks are deferred until ingesterVerifyBatch(), so they can be done for the whole batch at once
+
+void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, IngesterVerifyBatch &verifyBatch) {
+    if (origJson.is_object()) {
+        const auto &obj = origJson.get_object();
+        auto it = obj.find("id");
+        if (it != obj.end() && it->second.is_string() && ingesterIsDuplicate(txn, connId, unverifiedEventId(it->second.get_string()))) return;
+    }
+
+    std::string flatStr, jsonStr;
+    DeferredEventChecks checks;
+
+    parseAndVerifyEvent(origJson, secpCtx, true, true, flatStr, jsonStr, &checks);
+
+    ingesterAddToVerifyBatch(connId, std::move(ipAddr), std::move(flatStr), std::move(jsonStr), std::move(checks), verifyBatch);
+}
+
+void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, EventParser &parsedEvent, IngesterVerifyBatch &verifyBatch) {
+    if (ingesterIsDuplicate(txn, connId, unverifiedEventId(parsedEvent.id))) return;
+
     std::string flatStr, jsonStr;
+    DeferredEventChecks checks;
 
-    parseAndVerifyEvent(origJson, secpCtx, true, true, flatStr, jsonStr);
+    parseAndVerifyEvent(parsedEvent, secpCtx, true, true, flatStr, jsonStr, &checks);
 
+    ingesterAddToVerifyBatch(connId, std::move(ipAddr), std::move(flatStr), std::move(jsonStr), std::move(checks), verifyBatch);
+}
+
+void RelayServer::ingesterAddToVerifyBatch(uint64_t connId, std::string ipAddr, std::string flatStr, std::string jsonStr, DeferredEventChecks checks, IngesterVerifyBatch &verifyBatch) {
     auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
+    verifyBatch.verifier.add(std::move(checks), sv(flat->id()), sv(flat->pubkey()));
+    verifyBatch.events.emplace_back(IngesterVerifyBatch::Event{ connId, std::move(ipAddr), std::move(flatStr), std::move(jsonStr) });
+}
 
-    {
-        auto existing = lookupEventById(txn, sv(flat->id()));
-        if (existing) {
-            LI << "Duplicate event, skipping";
-            sendOKResponse(connId, to_hex(sv(flat->id())), true, "duplicate: have this event");
-            return;
+void RelayServer::ingesterVerifyBatch(secp256k1_context *secpCtx, IngesterVerifyBatch &verifyBatch, std::vector<MsgWriter> &output) {
+    auto &verifier = verifyBatch.verifier;
+
+    verifier.verify(secpCtx);
+
+    ingesterStats.sigBatchVerifies += verifier.sigVerifier.numBatchVerifies;
+    ingesterStats.sigSingleVerifies += verifier.sigVerifier.numSingleVerifies;
+    verifier.sigVerifier.numBatchVerifies = verifier.sigVerifier.numSingleVerifies = 0;
+
+    if (auto *pubkeyCache = verifier.sigVerifier.pubkeyCache) {
+        ingesterStats.pubkeyCacheHits += pubkeyCache->hits;
+        ingesterStats.pubkeyCacheMisses += pubkeyCache->misses;
+        pubkeyCache->hits = pubkeyCache->misses = 0;
+    }
+
+    for (size_t i = 0; i < verifyBatch.events.size(); i++) {
+        auto &ev = verifyBatch.events[i];
+        auto &item = verifier.items[i];
+
+        if (item.error.size()) {
+            sendOKResponse(ev.connId, to_hex(item.id), false, std::string("invalid: ") + item.error);
+            LI << "Rejected invalid event: " << item.error;
+            continue;
         }
+
+        ingesterStats.verified++;
+        ingesterQueueEvent(ev.connId, std::move(ev.ipAddr), std::move(ev.flatStr), std::move(ev.jsonStr), output);
     }
 
-    output.emplace_back(MsgWriter{MsgWriter::AddEvent{connId, std::move(ipAddr), hoytech::curr_time_us(), std::move(flatStr), std::move(jsonStr)}});
+    verifyBatch.events.clear();
+    verifier.clear();
+}
+
+// Checked before verification. An id found here was already verified, either by the writer or an ingester.
+// If it is still in flight, the writer answers this connection along with the original, since it may yet be rejected
+
+bool RelayServer::ingesterIsDuplicate(lmdb::txn &txn, uint64_t connId, std::string_view id) {
+    if (id.size() != 32) return false;
+
+    if (inFlightEvents.addDuplicate(id, connId)) {
+        ingesterStats.dupsInFlight++;
+        LI << "Duplicate event, waiting for original";
+        return true;
+    }
+
+    if (!lookupEventById(txn, id)) return false;
+
+    ingesterStats.dupsStored++;
+    LI << "Duplicate event, skipping";
+    sendOKResponse(connId, to_hex(id), true, "duplicate: have this event");
+    return true;
+}
+
+void RelayServer::ingesterQueueEvent(uint64_t connId, std::string ipAddr, std::string flatStr, std::string jsonStr, std::vector<MsgWriter> &output) {
+    auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
+
+    // Another ingester may have verified the same event concurrently, in which case the writer answers this
+    // connection along with the original. The writer removes the id once processed
+
+    if (!inFlightEvents.insert(sv(flat->id()), connId)) {
+        ingesterStats.dupsVerified++;
+        LI << "Duplicate event, waiting for original";
+        return;
+    }
+
+    // Index keys are built here rather than in the single writer thread
+
+    auto keys = prepareIndexKeys(flat);
+
+    output.emplace_back(MsgWriter{MsgWriter::AddEvent{connId, std::move(ipAddr), hoytech::curr_time_us(), std::move(flatStr), std::move(jsonStr), std::move(keys)}});
 }
 
-void RelayServer::ingesterProcessReq(lmdb::txn &txn, uint64_t connId, const tao::json::value &arr) {
+void RelayServer::ingesterProcessReq(lmdb::txn &txn, uint64_t connId, std::string_view ipAddr, const tao::json::value &arr) {
     if (arr.get_array().size() < 2 + 1) throw herr("arr too small");
     if (arr.get_array().size() > 2 + 20) throw herr("arr too big");
 
     Subscription sub(connId, arr[1].get_string(), NostrFilterGroup(arr));
+    sub.ipAddr = ipAddr;
 
     tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::NewSub{std::move(sub)}});
 }
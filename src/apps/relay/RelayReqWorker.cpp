@@ -3,28 +3,154 @@
 #include "QueryScheduler.h"
 
 
+void RelayServer::recordSlowQuery(DBQuery &q) {
+    auto scans = tao::json::empty_array;
+
+    for (const auto &s : q.scanSummaries) {
+        scans.push_back(tao::json::value({
+            { "index", s.index },
+            { "cursors", s.cursors },
+            { "timeUs", s.timeUs },
+            { "work", s.work },
+            { "saveRestores", s.saveRestores },
+            { "recsFound", s.recsFound },
+            { "keysVisited", s.keysVisited },
+            { "seeks", s.seeks },
+            { "rejected", s.rejected },
+            { "eventLookups", s.eventLookups },
+            { "payloadBytes", s.payloadBytes },
+        }));
+    }
+
+    auto record = tao::json::value({
+        { "ts", hoytech::curr_time_s() },
+        { "connId", q.sub.connId },
+        { "ip", q.sub.ipAddr.size() ? renderIP(q.sub.ipAddr) : "" },
+        { "subId", q.sub.subId.str() },
+        { "filters", q.sub.filterGroup.toJson() },
+        { "timeUs", q.totalTime },
+        { "work", q.totalWork },
+        { "saveRestores", q.totalSaveRestores },
+        { "recsSent", q.sentEventsFull.size() },
+        { "scans", std::move(scans) },
+    });
+
+    slowQueryLog.add(q.totalTime, q.totalWork, tao::json::to_string(record));
+}
+
+
 void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
     Decompressor decomp;
     QueryScheduler queries;
 
+    queries.recordSent = cfg().relay__reqWorker__cacheMaxEntries > 0;
+
     queries.onEvent = [&](lmdb::txn &txn, const auto &sub, uint64_t levId, std::string_view eventPayload){
         sendEvent(sub.connId, sub.subId, decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
     };
 
+    queries.onShared = [&](const auto &, DBQuery &){
+        reqWorkerStats.sharedScans++;
+    };
+
+    std::vector<std::optional<std::string>> continuations; // of the query being completed, for its subs' EOSEs
+
+    queries.onQueryComplete = [&](DBQuery &q){
+        uint64_t timeThreshold = cfg().relay__logging__slowQueryMicroseconds;
+        uint64_t workThreshold = cfg().relay__logging__slowQueryWork;
+
+        if ((timeThreshold && q.totalTime > timeThreshold) || (workThreshold && q.totalWork > workThreshold)) {
+            recordSlowQuery(q);
+        }
+
+        continuations = q.continuations;
+
+        if (queries.recordSent && q.sentInOrder.size() <= cfg().relay__reqWorker__cacheMaxResultSize && ReqResultCache::cacheable(q.sub.filterGroup)) {
+            reqResultCache.add(tao::json::to_string(q.sub.filterGroup.toJson()), q.sentInOrder, q.sub.latestEventId,
+                               cfg().relay__reqWorker__cacheMaxEntries, cfg().relay__reqWorker__cacheMaxBytes);
+        }
+    };
+
     queries.onComplete = [&](Subscription &sub){
-        sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() })));
+        if (sub.filterGroup.wantsContinuation()) {
+            // Non-standard: a token (or null if there are no more results) for each filter, in the REQ's order
+            tao::json::value tokens = tao::json::empty_array;
+            for (const auto &c : continuations) tokens.push_back(c ? tao::json::value(*c) : tao::json::null);
+            sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str(), std::move(tokens) })));
+        } else {
+            sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() })));
+        }
+
         tpReqMonitor.dispatch(sub.connId, MsgReqMonitor{MsgReqMonitor::NewSub{std::move(sub)}});
     };
 
+    // If sub's results are cached and still valid, sends them along with EOSE and returns true
+
+    auto serveFromCache = [&](lmdb::txn &txn, Subscription &sub){
+        std::vector<std::string_view> eventPayloads;
+        uint64_t latestEventId;
+
+        if (!reqResultCache.lookup(txn, tao::json::to_string(sub.filterGroup.toJson()), sub.filterGroup, cfg().relay__reqWorker__cacheMaxLevIdLag,
+                                   eventPayloads, latestEventId)) {
+            return false;
+        }
+
+        queries.removeSub(sub.connId, sub.subId); // may be replacing a REQ that is still scanning
+
+        for (auto eventPayload : eventPayloads) {
+            sendEvent(sub.connId, sub.subId, decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
+        }
+
+        sub.latestEventId = latestEventId;
+        queries.onComplete(sub);
+
+        return true;
+    };
+
+    auto &threadStats = reqWorkerStats.threads[thr.id];
+
+    // Hand paused queries to idle threads, while this one has others waiting
+
+    queries.onPaused = [&](DBQuery *q){
+        if (!cfg().relay__reqWorker__workStealing) return false;
+
+        for (uint64_t i = 1; i < tpReqWorker.numThreads; i++) {
+            uint64_t other = (thr.id + i) % tpReqWorker.numThreads;
+            bool expected = true;
+
+            if (reqWorkerStats.threads[other].idle.compare_exchange_strong(expected, false)) {
+                tpReqWorker.dispatch(other, MsgReqWorker{MsgReqWorker::RunQuery{q, thr.id}});
+                return true;
+            }
+        }
+
+        return false;
+    };
+
     while(1) {
-        auto newMsgs = queries.running.empty() ? thr.inbox.pop_all() : thr.inbox.pop_all_no_wait();
+        bool idle = queries.running.empty();
+        if (idle) threadStats.idle = true;
+
+        auto newMsgs = idle ? thr.inbox.pop_all() : thr.inbox.pop_all_no_wait();
+
+        threadStats.idle = false;
+        uint64_t startTime = hoytech::curr_time_us();
 
         auto txn = env.txn_ro();
 
+        queries.shareScans = cfg().relay__reqWorker__shareScans;
+        queries.maxShareLevIdLag = cfg().relay__reqWorker__shareScansMaxLevIdLag;
+        queries.prioritiseIdLookups = cfg().relay__reqWorker__prioritiseIdLookups;
+        queries.demoteAfterMicroseconds = cfg().relay__reqWorker__demoteAfterMicroseconds;
+
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgReqWorker::NewSub>(&newMsg.msg)) {
                 auto connId = msg->sub.connId;
 
+                reqWorkerStats.reqs++;
+
+                if (queries.recordSent && ReqResultCache::cacheable(msg->sub.filterGroup) && serveFromCache(txn, msg->sub)) continue;
+
                 if (!queries.addSub(txn, std::move(msg->sub))) {
                     sendNoticeError(connId, std::string("too many concurrent REQs"));
                 }
@@ -36,11 +162,19 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgReqWorker::CloseConn>(&newMsg.msg)) {
                 queries.closeConn(msg->connId);
                 tpReqMonitor.dispatch(msg->connId, MsgReqMonitor{MsgReqMonitor::CloseConn{msg->connId}});
+            } else if (auto msg = std::get_if<MsgReqWorker::RunQuery>(&newMsg.msg)) {
+                bool complete = queries.processTimeslice(txn, msg->query);
+                threadStats.slicesStolen++;
+                tpReqWorker.dispatch(msg->homeThread, MsgReqWorker{MsgReqWorker::QueryReturned{msg->query, complete}});
+            } else if (auto msg = std::get_if<MsgReqWorker::QueryReturned>(&newMsg.msg)) {
+                queries.returnQuery(msg->query, msg->complete);
             }
         }
 
         queries.process(txn);
 
         txn.abort();
+
+        threadStats.busyUs += hoytech::curr_time_us() - startTime;
     }
 }
@@ -14,11 +14,18 @@
 
 #include "Subscription.h"
 #include "ThreadPool.h"
+#include "TimedQueue.h"
 #include "events.h"
 #include "filters.h"
 #include "Decompressor.h"
+#include "InFlightEvents.h"
+#include "EventBatchVerifier.h"
+#include "Histogram.h"
+#include "SlowQueryLog.h"
+#include "ReqResultCache.h"
 
 
+struct DBQuery;
 
 
 struct MsgWebsocket : NonCopyable {
@@ -68,6 +75,7 @@ struct MsgWriter : NonCopyable {
         uint64_t receivedAt;
         std::string flatStr;
         std::string jsonStr;
+        PreparedIndexKeys keys;
     };
 
     using Var = std::variant<AddEvent>;
@@ -89,7 +97,17 @@ struct MsgReqWorker : NonCopyable {
         uint64_t connId;
     };
 
-    using Var = std::variant<NewSub, RemoveSub, CloseConn>;
+    struct RunQuery { // sent to an idle thread to run one timeslice of another thread's query
+        DBQuery *query;
+        uint64_t homeThread;
+    };
+
+    struct QueryReturned { // sent back to the query's home thread after a RunQuery
+        DBQuery *query;
+        bool complete;
+    };
+
+    using Var = std::variant<NewSub, RemoveSub, CloseConn, RunQuery, QueryReturned>;
     Var msg;
     MsgReqWorker(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -144,14 +162,71 @@ struct MsgNegentropy : NonCopyable {
 };
 
 
+struct IngesterStats {
+    std::atomic<uint64_t> verified = 0; // events that had their id and signature checked
+    std::atomic<uint64_t> dupsStored = 0; // skipped verification: already in DB
+    std::atomic<uint64_t> dupsInFlight = 0; // skipped verification: queued for writer
+    std::atomic<uint64_t> dupsVerified = 0; // verified, then found to be queued by another ingester
+    std::atomic<uint64_t> sigBatchVerifies = 0; // multi-signature checks, when relay.batchSigVerify is enabled
+    std::atomic<uint64_t> sigSingleVerifies = 0; // individual signature checks
+    std::atomic<uint64_t> pubkeyCacheHits = 0;
+    std::atomic<uint64_t> pubkeyCacheMisses = 0;
+};
+
+struct WriterStats {
+    Log2Histogram batchSize; // events per write txn
+    Log2Histogram commitLatencyUs; // from start of write txn until OKs are ready to send
+
+    // Watermarks: every event with levId <= committedLevId has been committed, and <= durableLevId fsynced.
+    // durableLevId isn't tracked in async mode
+    std::atomic<uint64_t> committedLevId = 0;
+    std::atomic<uint64_t> durableLevId = 0;
+};
+
+struct ReqWorkerThreadStats {
+    std::atomic<bool> idle = false; // waiting for messages, so can be handed queries from other threads
+    std::atomic<uint64_t> busyUs = 0;
+    std::atomic<uint64_t> slicesStolen = 0; // timeslices run on behalf of other threads
+};
+
+struct ReqWorkerStats {
+    std::atomic<uint64_t> reqs = 0; // subscriptions received
+    std::atomic<uint64_t> sharedScans = 0; // subscriptions that joined another's scan, see relay.reqWorker.shareScans
+    std::deque<ReqWorkerThreadStats> threads;
+};
+
+// Events from one ingester pop_all() batch, waiting to have their ids and signatures verified together
+
+struct IngesterVerifyBatch {
+    struct Event {
+        uint64_t connId;
+        std::string ipAddr;
+        std::string flatStr;
+        std::string jsonStr;
+    };
+
+    std::vector<Event> events; // parallel to verifier.items
+    EventBatchVerifier verifier;
+};
+
+
 struct RelayServer {
     std::unique_ptr<uS::Async> hubTrigger;
 
+    // Shared between threads
+
+    InFlightEvents inFlightEvents;
+    IngesterStats ingesterStats;
+    WriterStats writerStats;
+    ReqWorkerStats reqWorkerStats;
+    SlowQueryLog slowQueryLog;
+    ReqResultCache reqResultCache;
+
     // Thread Pools
 
     ThreadPool<MsgWebsocket> tpWebsocket;
     ThreadPool<MsgIngester> tpIngester;
-    ThreadPool<MsgWriter> tpWriter;
+    ThreadPool<MsgWriter, TimedQueue<MsgWriter>> tpWriter;
     ThreadPool<MsgReqWorker> tpReqWorker;
     ThreadPool<MsgReqMonitor> tpReqMonitor;
     ThreadPool<MsgNegentropy> tpNegentropy;
@@ -163,20 +238,27 @@ struct RelayServer {
     void runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr);
 
     void runIngester(ThreadPool<MsgIngester>::Thread &thr);
-    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output);
-    void ingesterProcessReq(lmdb::txn &txn, uint64_t connId, const tao::json::value &origJson);
+    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, IngesterVerifyBatch &verifyBatch);
+    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, EventParser &parsedEvent, IngesterVerifyBatch &verifyBatch);
+    void ingesterAddToVerifyBatch(uint64_t connId, std::string ipAddr, std::string flatStr, std::string jsonStr, DeferredEventChecks checks, IngesterVerifyBatch &verifyBatch);
+    void ingesterVerifyBatch(secp256k1_context *secpCtx, IngesterVerifyBatch &verifyBatch, std::vector<MsgWriter> &output);
+    bool ingesterIsDuplicate(lmdb::txn &txn, uint64_t connId, std::string_view id);
+    void ingesterQueueEvent(uint64_t connId, std::string ipAddr, std::string flatStr, std::string jsonStr, std::vector<MsgWriter> &output);
+    void ingesterProcessReq(lmdb::txn &txn, uint64_t connId, std::string_view ipAddr, const tao::json::value &origJson);
     void ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &origJson);
     void ingesterProcessNegentropy(lmdb::txn &txn, Decompressor &decomp, uint64_t connId, const tao::json::value &origJson);
 
-    void runWriter(ThreadPool<MsgWriter>::Thread &thr);
+    void runWriter(ThreadPool<MsgWriter, TimedQueue<MsgWriter>>::Thread &thr);
 
     void runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr);
+    void recordSlowQuery(DBQuery &q);
 
     void runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr);
 
     void runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr);
 
     void runCron();
+    void logStats();
 
     void runSignalHandler();
 
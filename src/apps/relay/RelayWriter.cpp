@@ -1,13 +1,179 @@
 #include "RelayServer.h"
 
 #include "PluginWritePolicy.h"
+#include "WriterDurability.h"
 
 
-void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
+// OK responses for a committed batch, held until the batch is durable
+
+struct WriterCommittedBatch {
+    struct OK {
+        uint64_t connId;
+        std::string id;
+        bool written;
+        std::string message;
+    };
+
+    std::vector<OK> oks;
+    uint64_t startTime; // when the batch's write txn began
+    uint64_t levId; // committedLevId after the batch was committed
+};
+
+
+void RelayServer::runWriter(ThreadPool<MsgWriter, TimedQueue<MsgWriter>>::Thread &thr) {
     PluginWritePolicy writePolicy;
 
+    auto durability = parseWriterDurability(cfg().relay__writer__durability);
+
+    // Group commit: with MDB_NOMETASYNC, a commit only flushes the data pages. The meta page is flushed
+    // by the sync thread while the next batch is being prepared and written, and the OKs for every batch
+    // covered by that flush are then sent together. This keeps LMDB's integrity guarantees: a crash can
+    // lose batches that haven't been acknowledged yet, but can't corrupt the DB.
+
+    bool groupCommit = durability == WriterDurability::Sync && cfg().relay__writer__groupCommit;
+    bool okAfterDurable = durability == WriterDurability::Sync || (durability == WriterDurability::Periodic && cfg().relay__writer__okAfterDurable);
+
+    {
+        unsigned int flags = writerDurabilityEnvFlags(durability);
+        if (groupCommit) flags |= MDB_NOMETASYNC;
+        if (flags) env.lmdb_env.set_flags(flags, true);
+    }
+
+    LI << "Writer durability: " << writerDurabilityName(durability) << (groupCommit ? " (group commit)" : "")
+       << (okAfterDurable ? ", OKs sent once durable" : ", OKs sent once committed");
+
+    TimedQueue<WriterCommittedBatch> committedBatches; // only used when okAfterDurable
+
+    auto sendOKs = [&](auto &batches){
+        auto now = hoytech::curr_time_us();
+        std::vector<MsgWebsocket> replies;
+
+        for (auto &batch : batches) {
+            writerStats.commitLatencyUs.add(now - batch.startTime);
+
+            for (auto &ok : batch.oks) {
+                auto reply = tao::json::to_string(tao::json::value::array({ "OK", to_hex(ok.id), ok.written, ok.message }));
+                replies.emplace_back(MsgWebsocket{MsgWebsocket::Send{ok.connId, reply}});
+                for (auto dupConnId : inFlightEvents.erase(ok.id)) replies.emplace_back(MsgWebsocket{MsgWebsocket::Send{dupConnId, reply}});
+            }
+        }
+
+        if (replies.size()) {
+            tpWebsocket.dispatchMulti(0, replies);
+            hubTrigger->send();
+        }
+    };
+
+    // For events that are answered without being written. Connections that sent the event again while it was in
+    // flight get the same OK
+
+    auto sendRejectedOK = [&](uint64_t connId, std::string_view id, bool written, std::string_view message){
+        auto eventIdHex = to_hex(id);
+        sendOKResponse(connId, eventIdHex, written, message);
+        for (auto dupConnId : inFlightEvents.erase(id)) sendOKResponse(dupConnId, eventIdHex, written, message);
+    };
+
+    // Returns false if the sync failed, in which case the durable watermark isn't advanced
+
+    auto syncEnv = [&]{
+        uint64_t levId = writerStats.committedLevId;
+
+        try {
+            env.lmdb_env.sync(true);
+        } catch (std::exception &e) {
+            LE << "Error syncing DB: " << e.what();
+            return false;
+        }
+
+        writerStats.durableLevId = levId;
+        return true;
+    };
+
+    std::thread syncThread;
+
+    if (durability == WriterDurability::Sync) {
+        syncThread = std::thread([&]{
+            setThreadName("Writer sync");
+
+            std::deque<WriterCommittedBatch> held; // in levId order
+
+            while (1) {
+                // After a failed sync, wake up again to retry it even if nothing else is committed
+
+                auto batches = held.empty() ? committedBatches.pop_all()
+                                            : committedBatches.pop_all_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+
+                for (auto &b : batches) held.emplace_back(std::move(b));
+                if (held.empty()) continue;
+
+                if (groupCommit) {
+                    syncEnv();
+                } else {
+                    writerStats.durableLevId = held.back().levId; // each commit was fsynced
+                }
+
+                std::vector<WriterCommittedBatch> ready;
+
+                while (held.size() && held.front().levId <= writerStats.durableLevId) {
+                    ready.emplace_back(std::move(held.front()));
+                    held.pop_front();
+                }
+
+                sendOKs(ready);
+            }
+        });
+    } else if (durability == WriterDurability::Periodic) {
+        syncThread = std::thread([&]{
+            setThreadName("Writer sync");
+
+            std::deque<WriterCommittedBatch> held; // in levId order
+
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(cfg().relay__writer__syncIntervalMilliseconds));
+
+                if (writerStats.committedLevId != writerStats.durableLevId) syncEnv();
+
+                if (!okAfterDurable) continue;
+
+                for (auto &b : committedBatches.pop_all_no_wait()) held.emplace_back(std::move(b));
+
+                std::vector<WriterCommittedBatch> ready;
+
+                while (held.size() && held.front().levId <= writerStats.durableLevId) {
+                    ready.emplace_back(std::move(held.front()));
+                    held.pop_front();
+                }
+
+                sendOKs(ready);
+            }
+        });
+    }
+
+    std::deque<MsgWriter> pending;
+
     while(1) {
-        auto newMsgs = thr.inbox.pop_all();
+        // Collect a batch, waiting up to maxBatchWaitMicroseconds for it to fill
+
+        uint64_t maxBatchSize = std::max(cfg().relay__writer__maxBatchSize, (uint64_t)1);
+
+        if (pending.empty()) pending = thr.inbox.pop_all();
+
+        {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(cfg().relay__writer__maxBatchWaitMicroseconds);
+
+            while (pending.size() < maxBatchSize) {
+                auto moreMsgs = thr.inbox.pop_all_until(deadline);
+                if (moreMsgs.empty()) break; // deadline passed
+                for (auto &m : moreMsgs) pending.emplace_back(std::move(m));
+            }
+        }
+
+        std::vector<MsgWriter> newMsgs;
+
+        while (pending.size() && newMsgs.size() < maxBatchSize) {
+            newMsgs.emplace_back(std::move(pending.front()));
+            pending.pop_front();
+        }
 
         // Prepare messages
 
@@ -15,24 +181,36 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgWriter::AddEvent>(&newMsg.msg)) {
-                tao::json::value evJson = tao::json::from_string(msg->jsonStr);
                 EventSourceType sourceType = msg->ipAddr.size() == 4 ? EventSourceType::IP4 : EventSourceType::IP6;
                 std::string okMsg;
-                auto res = writePolicy.acceptEvent(evJson, msg->receivedAt, sourceType, msg->ipAddr, okMsg);
+                auto res = WritePolicyResult::Accept;
+
+                if (writePolicy.active()) {
+                    // jsonStr was normalised by the ingester, so it can be passed to the plugin without re-parsing
+                    auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(msg->flatStr.data());
+                    res = writePolicy.acceptEventJson(msg->jsonStr, to_hex(sv(flat->id())), msg->receivedAt, sourceType, msg->ipAddr, okMsg);
+                }
 
                 if (res == WritePolicyResult::Accept) {
                     newEvents.emplace_back(std::move(msg->flatStr), std::move(msg->jsonStr), msg->receivedAt, sourceType, std::move(msg->ipAddr), msg);
+                    newEvents.back().prepared = std::move(msg->keys);
                 } else {
                     auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(msg->flatStr.data());
                     auto eventIdHex = to_hex(sv(flat->id()));
 
                     LI << "[" << msg->connId << "] write policy blocked event " << eventIdHex << ": " << okMsg;
 
-                    sendOKResponse(msg->connId, eventIdHex, res == WritePolicyResult::ShadowReject, okMsg);
+                    sendRejectedOK(msg->connId, sv(flat->id()), res == WritePolicyResult::ShadowReject, okMsg);
                 }
             }
         }
 
+        if (newEvents.empty()) continue;
+
+        writerStats.batchSize.add(newEvents.size());
+
+        auto startTime = hoytech::curr_time_us();
+
         try {
             auto txn = env.txn_rw();
             writeEvents(txn, newEvents);
@@ -42,28 +220,34 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
 
             for (auto &newEvent : newEvents) {
                 auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(newEvent.flatStr.data());
-                auto eventIdHex = to_hex(sv(flat->id()));
                 MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
 
                 std::string message = "Write error: ";
                 message += e.what();
 
-                sendOKResponse(addEventMsg->connId, eventIdHex, false, message);
+                sendRejectedOK(addEventMsg->connId, sv(flat->id()), false, message);
             }
 
             continue;
         }
 
-        // Log
+        // Log, and send OKs or hand them to the sync thread
+
+        for (auto &newEvent : newEvents) {
+            if (newEvent.status == EventWriteStatus::Written && newEvent.levId > writerStats.committedLevId) writerStats.committedLevId = newEvent.levId;
+        }
+
+        WriterCommittedBatch committed;
+        committed.startTime = startTime;
+        committed.levId = writerStats.committedLevId;
 
         for (auto &newEvent : newEvents) {
             auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(newEvent.flatStr.data());
-            auto eventIdHex = to_hex(sv(flat->id()));
             std::string message;
             bool written = false;
 
             if (newEvent.status == EventWriteStatus::Written) {
-                LI << "Inserted event. id=" << eventIdHex << " levId=" << newEvent.levId;
+                LI << "Inserted event. id=" << to_hex(sv(flat->id())) << " levId=" << newEvent.levId;
                 written = true;
             } else if (newEvent.status == EventWriteStatus::Duplicate) {
                 message = "duplicate: have this event";
@@ -75,12 +259,20 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
             }
 
             if (newEvent.status != EventWriteStatus::Written) {
-                LI << "Rejected event. " << message << ", id=" << eventIdHex;
+                LI << "Rejected event. " << message << ", id=" << to_hex(sv(flat->id()));
             }
 
             MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
 
-            sendOKResponse(addEventMsg->connId, eventIdHex, written, message);
+            committed.oks.emplace_back(WriterCommittedBatch::OK{ addEventMsg->connId, std::string(sv(flat->id())), written, std::move(message) });
+        }
+
+        if (okAfterDurable) {
+            committedBatches.push_move(std::move(committed));
+        } else {
+            std::vector<WriterCommittedBatch> batches;
+            batches.emplace_back(std::move(committed));
+            sendOKs(batches);
         }
     }
 }
@@ -2,6 +2,7 @@
 #include <signal.h>
 
 #include "RelayServer.h"
+#include "WriterDurability.h"
 
 
 
@@ -19,6 +20,12 @@ void RelayServer::run() {
         if (s != 0) throw herr("Unable to set sigmask: ", strerror(errno));
     }
 
+    if (parseWriterDurability(cfg().relay__writer__durability) == WriterDurability::Periodic && cfg().relay__writer__syncIntervalMilliseconds == 0) {
+        throw herr("relay.writer.syncIntervalMilliseconds must be at least 1 in periodic mode");
+    }
+
+    slowQueryLog.init(cfg().relay__logging__slowQueryRingSize, cfg().relay__logging__slowQueryFile);
+
     tpWebsocket.init("Websocket", 1, [this](auto &thr){
         runWebsocket(thr);
     });
@@ -31,6 +38,8 @@ void RelayServer::run() {
         runWriter(thr);
     });
 
+    for (uint64_t i = 0; i < cfg().relay__numThreads__reqWorker; i++) reqWorkerStats.threads.emplace_back();
+
     tpReqWorker.init("ReqWorker", cfg().relay__numThreads__reqWorker, [this](auto &thr){
         runReqWorker(thr);
     });
@@ -3,21 +3,54 @@
 #include "events.h"
 
 
-std::string nostrJsonToFlat(const tao::json::value &v) {
-    flatbuffers::FlatBufferBuilder builder; // FIXME: pre-allocate size approximately the same as orig JSON?
+// Scratch space for building flatbuffers, re-used by each thread so that converting an event doesn't
+// need to allocate once the buffers have grown to fit the largest events seen
 
-    // Extract values from JSON, add strings to builder
+struct FlatEventScratch {
+    flatbuffers::FlatBufferBuilder builder{1024};
+    std::vector<flatbuffers::Offset<NostrIndex::TagGeneral>> tagsGeneral;
+    std::vector<flatbuffers::Offset<NostrIndex::TagFixed32>> tagsFixed32;
 
-    auto id = from_hex(v.at("id").get_string(), false);
-    auto pubkey = from_hex(v.at("pubkey").get_string(), false);
-    uint64_t created_at = v.at("created_at").get_unsigned();
-    uint64_t kind = v.at("kind").get_unsigned();
+    void clear() {
+        builder.Clear();
+        tagsGeneral.clear();
+        tagsFixed32.clear();
+    }
+};
 
-    if (id.size() != 32) throw herr("unexpected id size");
-    if (pubkey.size() != 32) throw herr("unexpected pubkey size");
+static thread_local FlatEventScratch flatEventScratch;
 
-    std::vector<flatbuffers::Offset<NostrIndex::TagGeneral>> tagsGeneral;
-    std::vector<flatbuffers::Offset<NostrIndex::TagFixed32>> tagsFixed32;
+static uint8_t hexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    throw herr("invalid hex character"); // upper-case is rejected, as with from_hex()
+}
+
+// Returns false if hex is the wrong length to decode to 32 bytes
+
+static bool decodeHex32(std::string_view hex, uint8_t *out) {
+    if (hex.size() != 64) return false;
+    for (size_t i = 0; i < 32; i++) out[i] = (hexNibble(hex[i * 2]) << 4) | hexNibble(hex[i * 2 + 1]);
+    return true;
+}
+
+// forEachTag is called with a callback that should be invoked as cb(numFields, tagName, tagVal) for every tag
+
+template<typename F>
+static void buildFlatEvent(std::string_view idHex, std::string_view pubkeyHex, uint64_t created_at, uint64_t kind, size_t numTags, F forEachTag, std::string &output) {
+    auto &scratch = flatEventScratch;
+    scratch.clear();
+
+    auto &builder = scratch.builder;
+    auto &tagsGeneral = scratch.tagsGeneral;
+    auto &tagsFixed32 = scratch.tagsFixed32;
+
+    // Extract values from JSON, add strings to builder
+
+    uint8_t id[32], pubkey[32];
+
+    if (!decodeHex32(idHex, id)) throw herr("unexpected id size");
+    if (!decodeHex32(pubkeyHex, pubkey)) throw herr("unexpected pubkey size");
 
     uint64_t expiration = 0;
 
@@ -29,25 +62,21 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
         ));
     }
 
-    if (v.at("tags").get_array().size() > cfg().events__maxNumTags) throw herr("too many tags: ", v.at("tags").get_array().size());
-    for (auto &tagArr : v.at("tags").get_array()) {
-        auto &tag = tagArr.get_array();
-        if (tag.size() < 1) throw herr("too few fields in tag");
-
-        auto tagName = tag.at(0).get_string();
-        auto tagVal = tag.size() >= 2 ? tag.at(1).get_string() : "";
+    if (numTags > cfg().events__maxNumTags) throw herr("too many tags: ", numTags);
+    forEachTag([&](size_t numFields, std::string_view tagName, std::string_view tagVal) {
+        if (numFields < 1) throw herr("too few fields in tag");
 
         if (tagName == "e" || tagName == "p") {
-            tagVal = from_hex(tagVal, false);
-            if (tagVal.size() != 32) throw herr("unexpected size for fixed-size tag");
+            uint8_t tagValBin[32];
+            if (!decodeHex32(tagVal, tagValBin)) throw herr("unexpected size for fixed-size tag");
 
             tagsFixed32.emplace_back(NostrIndex::CreateTagFixed32(builder,
                 (uint8_t)tagName[0],
-                (NostrIndex::Fixed32Bytes*)tagVal.data()
+                (NostrIndex::Fixed32Bytes*)tagValBin
             ));
         } else if (tagName == "expiration") {
             if (expiration == 0) {
-                expiration = parseUint64(tagVal);
+                expiration = parseUint64(std::string(tagVal));
                 if (expiration < 100) throw herr("invalid expiration");
             }
         } else if (tagName.size() == 1) {
@@ -60,7 +89,7 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
                 ));
             }
         }
-    }
+    });
 
     if (isParamReplaceableKind(kind)) {
         // Append virtual d-tag
@@ -77,8 +106,8 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
     // Create flatbuffer
 
     auto eventPtr = NostrIndex::CreateEvent(builder,
-        (NostrIndex::Fixed32Bytes*)id.data(),
-        (NostrIndex::Fixed32Bytes*)pubkey.data(),
+        (NostrIndex::Fixed32Bytes*)id,
+        (NostrIndex::Fixed32Bytes*)pubkey,
         created_at,
         kind,
         builder.CreateVector<flatbuffers::Offset<NostrIndex::TagGeneral>>(tagsGeneral),
@@ -88,10 +117,53 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
 
     builder.Finish(eventPtr);
 
-    return std::string(reinterpret_cast<char*>(builder.GetBufferPointer()), builder.GetSize());
+    output.assign(reinterpret_cast<char*>(builder.GetBufferPointer()), builder.GetSize());
 }
 
-std::string nostrHash(const tao::json::value &origJson) {
+void nostrJsonToFlat(const tao::json::value &v, std::string &output) {
+    const auto &idHex = v.at("id").get_string();
+    const auto &pubkeyHex = v.at("pubkey").get_string();
+    uint64_t created_at = v.at("created_at").get_unsigned();
+    uint64_t kind = v.at("kind").get_unsigned();
+    const auto &tags = v.at("tags").get_array();
+
+    buildFlatEvent(idHex, pubkeyHex, created_at, kind, tags.size(), [&](auto cb){
+        for (auto &tagArr : tags) {
+            auto &tag = tagArr.get_array();
+            if (tag.size() < 1) throw herr("too few fields in tag");
+            cb(tag.size(), tag.at(0).get_string(), tag.size() >= 2 ? std::string_view(tag.at(1).get_string()) : std::string_view(""));
+        }
+    }, output);
+}
+
+void nostrJsonToFlat(const EventParser &parsed, std::string &output) {
+    buildFlatEvent(parsed.id, parsed.pubkey, parsed.created_at, parsed.kind, parsed.tags.size(), [&](auto cb){
+        for (const auto &tag : parsed.tags) {
+            cb(tag.numFields, parsed.tagName(tag), tag.numFields >= 2 ? parsed.tagVal(tag) : std::string_view(""));
+        }
+    }, output);
+}
+
+std::string nostrJsonToFlat(const tao::json::value &v) {
+    std::string output;
+    nostrJsonToFlat(v, output);
+    return output;
+}
+
+std::string nostrJsonToFlat(const EventParser &parsed) {
+    std::string output;
+    nostrJsonToFlat(parsed, output);
+    return output;
+}
+
+static std::string sha256(std::string_view input) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(input.data()), input.size(), hash);
+
+    return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+}
+
+std::string nostrHashPreimage(const tao::json::value &origJson) {
     tao::json::value arr = tao::json::empty_array;
 
     arr.emplace_back(0);
@@ -102,19 +174,19 @@ std::string nostrHash(const tao::json::value &origJson) {
     arr.emplace_back(origJson.at("tags"));
     arr.emplace_back(origJson.at("content"));
 
-    std::string encoded = tao::json::to_string(arr);
-
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<unsigned char*>(encoded.data()), encoded.size(), hash);
+    return tao::json::to_string(arr);
+}
 
-    return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+std::string nostrHash(const tao::json::value &origJson) {
+    return sha256(nostrHashPreimage(origJson));
 }
 
-bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey) {
+bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey, XOnlyPubkeyCache *pubkeyCache) {
     if (sig.size() != 64 || hash.size() != 32 || pubkey.size() != 32) throw herr("verify sig: bad input size");
 
     secp256k1_xonly_pubkey pubkeyParsed;
-    if (!secp256k1_xonly_pubkey_parse(ctx, &pubkeyParsed, (const uint8_t*)pubkey.data())) throw herr("verify sig: bad pubkey");
+    bool pubkeyValid = pubkeyCache ? pubkeyCache->parse(ctx, &pubkeyParsed, pubkey) : secp256k1_xonly_pubkey_parse(ctx, &pubkeyParsed, (const uint8_t*)pubkey.data());
+    if (!pubkeyValid) throw herr("verify sig: bad pubkey");
 
     return secp256k1_schnorrsig_verify(
                 ctx,
@@ -127,11 +199,19 @@ bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view ha
     );
 }
 
-void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson) {
+void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson, DeferredEventChecks *deferred) {
+    auto sig = from_hex(origJson.at("sig").get_string(), false);
+
+    if (deferred) {
+        deferred->hashPreimage = nostrHashPreimage(origJson);
+        deferred->sig = std::move(sig);
+        return;
+    }
+
     auto hash = nostrHash(origJson);
     if (hash != sv(flat->id())) throw herr("bad event id");
 
-    bool valid = verifySig(secpCtx, from_hex(origJson.at("sig").get_string(), false), sv(flat->id()), sv(flat->pubkey()));
+    bool valid = verifySig(secpCtx, sig, sv(flat->id()), sv(flat->pubkey()));
     if (!valid) throw herr("bad signature");
 }
 
@@ -152,11 +232,11 @@ void verifyEventTimestamp(const NostrIndex::Event *flat) {
     if (flat->expiration() != 0 && flat->expiration() <= now) throw herr("event expired");
 }
 
-void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr) {
-    flatStr = nostrJsonToFlat(origJson);
+void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr, DeferredEventChecks *deferred) {
+    nostrJsonToFlat(origJson, flatStr);
     auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
     if (verifyTime) verifyEventTimestamp(flat);
-    if (verifyMsg) verifyNostrEvent(secpCtx, flat, origJson);
+    if (verifyMsg) verifyNostrEvent(secpCtx, flat, origJson, deferred);
 
     // Build new object to remove unknown top-level fields from json
     jsonStr = tao::json::to_string(tao::json::value({
@@ -172,6 +252,30 @@ void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *se
     if (verifyMsg) verifyNostrEventJsonSize(jsonStr);
 }
 
+void parseAndVerifyEvent(EventParser &parsed, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr, DeferredEventChecks *deferred) {
+    nostrJsonToFlat(parsed, flatStr);
+    auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
+    if (verifyTime) verifyEventTimestamp(flat);
+
+    if (verifyMsg) {
+        auto sig = from_hex(parsed.sig, false);
+
+        if (deferred) {
+            deferred->hashPreimage = parsed.hashPreimage();
+            deferred->sig = std::move(sig);
+        } else {
+            if (sha256(parsed.hashPreimage()) != sv(flat->id())) throw herr("bad event id");
+
+            bool valid = verifySig(secpCtx, sig, sv(flat->id()), sv(flat->pubkey()));
+            if (!valid) throw herr("bad signature");
+        }
+    }
+
+    parsed.canonicalJson(jsonStr);
+
+    if (verifyMsg) verifyNostrEventJsonSize(jsonStr);
+}
+
 
 
 
@@ -250,14 +354,73 @@ std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t lev
 
 
 
-bool deleteEvent(lmdb::txn &txn, uint64_t levId) {
+bool deleteEvent(lmdb::txn &txn, uint64_t levId, IndexStatsDelta *statsDelta) {
+    if (auto view = env.lookup_Event(txn, levId)) {
+        if (statsDelta) {
+            statsDelta->add(view->flat_nested(), -1);
+        } else {
+            IndexStatsDelta delta;
+            delta.add(view->flat_nested(), -1);
+            delta.apply(txn);
+        }
+    }
+
     bool deleted = env.dbi_EventPayload.del(txn, lmdb::to_sv<uint64_t>(levId));
+    env.dbi_EventCover.del(txn, lmdb::to_sv<uint64_t>(levId));
     env.delete_Event(txn, levId);
     return deleted;
 }
 
 
 
+PreparedIndexKeys prepareIndexKeys(const NostrIndex::Event *flat) {
+    PreparedIndexKeys keys;
+
+    auto eventId = sv(flat->id());
+    auto pubkey = sv(flat->pubkey());
+    uint64_t indexTime = flat->created_at();
+
+    keys.eventId = std::string(eventId);
+
+    // Must match the Event indexPrelude in golpe.yaml
+
+    keys.id = makeKey_StringUint64(eventId, indexTime);
+    keys.pubkey = makeKey_StringUint64(pubkey, indexTime);
+    keys.kind = makeKey_Uint64Uint64(flat->kind(), indexTime);
+    keys.pubkeyKind = makeKey_StringUint64Uint64(pubkey, flat->kind(), indexTime);
+
+    for (const auto &tagPair : *(flat->tagsGeneral())) {
+        auto tagName = (char)tagPair->key();
+        auto tagVal = sv(tagPair->val());
+
+        keys.tag.push_back(makeKey_StringUint64(std::string(1, tagName) + std::string(tagVal), indexTime));
+
+        if (tagName == 'd' && keys.replace.size() == 0) {
+            keys.replace.push_back(makeKey_StringUint64(std::string(pubkey) + std::string(tagVal), flat->kind()));
+            if (isReplaceableKind(flat->kind()) || isParamReplaceableKind(flat->kind())) keys.replaceSearch = std::string(pubkey) + std::string(tagVal);
+        }
+    }
+
+    for (const auto &tagPair : *(flat->tagsFixed32())) {
+        auto tagName = (char)tagPair->key();
+        auto tagVal = sv(tagPair->val());
+
+        keys.tag.push_back(makeKey_StringUint64(std::string(1, tagName) + std::string(tagVal), indexTime));
+
+        if (flat->kind() == 5 && tagName == 'e') {
+            keys.deletion.push_back(std::string(tagVal) + std::string(pubkey));
+            keys.deletionTargets.push_back(std::string(tagVal));
+        }
+    }
+
+    std::sort(keys.tag.begin(), keys.tag.end());
+    std::sort(keys.deletion.begin(), keys.deletion.end());
+
+    keys.deletionProbe = std::string(eventId) + std::string(pubkey);
+
+    return keys;
+}
+
 void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLevel) {
     std::sort(evs.begin(), evs.end(), [](auto &a, auto &b) {
         auto aC = a.createdAt();
@@ -268,6 +431,7 @@ void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLev
 
     std::vector<uint64_t> levIdsToDelete;
     std::string tmpBuf;
+    IndexStatsDelta statsDelta;
 
     for (size_t i = 0; i < evs.size(); i++) {
         auto &ev = evs[i];
@@ -279,78 +443,80 @@ void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLev
             continue;
         }
 
-        if (env.lookup_Event__deletion(txn, std::string(sv(flat->id())) + std::string(sv(flat->pubkey())))) {
+        if (!ev.prepared || ev.prepared->eventId != sv(flat->id())) ev.prepared = prepareIndexKeys(flat);
+        auto &keys = *ev.prepared;
+
+        if (env.lookup_Event__deletion(txn, keys.deletionProbe)) {
             ev.status = EventWriteStatus::Deleted;
             continue;
         }
 
-        {
-            std::optional<std::string> replace;
+        if (keys.replaceSearch) {
+            const auto &searchStr = *keys.replaceSearch;
+            auto searchKey = makeKey_StringUint64(searchStr, flat->kind());
 
-            if (isReplaceableKind(flat->kind()) || isParamReplaceableKind(flat->kind())) {
-                for (const auto &tagPair : *(flat->tagsGeneral())) {
-                    auto tagName = (char)tagPair->key();
-                    if (tagName != 'd') continue;
-                    replace = std::string(sv(tagPair->val()));
-                    break;
-                }
-            }
+            env.generic_foreachFull(txn, env.dbi_Event__replace, searchKey, lmdb::to_sv<uint64_t>(MAX_U64), [&](auto k, auto v) {
+                ParsedKey_StringUint64 parsedKey(k);
+                if (parsedKey.s == searchStr && parsedKey.n == flat->kind()) {
+                    auto otherEv = lookupEventByLevId(txn, lmdb::from_sv<uint64_t>(v));
+
+                    auto thisTimestamp = flat->created_at();
+                    auto otherTimestamp = otherEv.flat_nested()->created_at();
 
-            if (replace) {
-                auto searchStr = std::string(sv(flat->pubkey())) + *replace;
-                auto searchKey = makeKey_StringUint64(searchStr, flat->kind());
-
-                env.generic_foreachFull(txn, env.dbi_Event__replace, searchKey, lmdb::to_sv<uint64_t>(MAX_U64), [&](auto k, auto v) {
-                    ParsedKey_StringUint64 parsedKey(k);
-                    if (parsedKey.s == searchStr && parsedKey.n == flat->kind()) {
-                        auto otherEv = lookupEventByLevId(txn, lmdb::from_sv<uint64_t>(v));
-
-                        auto thisTimestamp = flat->created_at();
-                        auto otherTimestamp = otherEv.flat_nested()->created_at();
-
-                        if (otherTimestamp < thisTimestamp ||
-                            (otherTimestamp == thisTimestamp && sv(flat->id()) < sv(otherEv.flat_nested()->id()))) {
-                            if (logLevel >= 1) LI << "Deleting event (d-tag). id=" << to_hex(sv(otherEv.flat_nested()->id()));
-                            levIdsToDelete.push_back(otherEv.primaryKeyId);
-                        } else {
-                            ev.status = EventWriteStatus::Replaced;
-                        }
+                    if (otherTimestamp < thisTimestamp ||
+                        (otherTimestamp == thisTimestamp && sv(flat->id()) < sv(otherEv.flat_nested()->id()))) {
+                        if (logLevel >= 1) LI << "Deleting event (d-tag). id=" << to_hex(sv(otherEv.flat_nested()->id()));
+                        levIdsToDelete.push_back(otherEv.primaryKeyId);
+                    } else {
+                        ev.status = EventWriteStatus::Replaced;
                     }
+                }
 
-                    return false;
-                }, true);
-            }
+                return false;
+            }, true);
         }
 
-        if (flat->kind() == 5) {
-            // Deletion event, delete all referenced events
-            for (const auto &tagPair : *(flat->tagsFixed32())) {
-                if (tagPair->key() == 'e') {
-                    auto otherEv = lookupEventById(txn, sv(tagPair->val()));
-                    if (otherEv && sv(otherEv->flat_nested()->pubkey()) == sv(flat->pubkey())) {
-                        if (logLevel >= 1) LI << "Deleting event (kind 5). id=" << to_hex(sv(tagPair->val()));
-                        levIdsToDelete.push_back(otherEv->primaryKeyId);
-                    }
-                }
+        // Deletion event, delete all referenced events
+
+        for (const auto &targetId : keys.deletionTargets) {
+            auto otherEv = lookupEventById(txn, targetId);
+            if (otherEv && sv(otherEv->flat_nested()->pubkey()) == sv(flat->pubkey())) {
+                if (logLevel >= 1) LI << "Deleting event (kind 5). id=" << to_hex(targetId);
+                levIdsToDelete.push_back(otherEv->primaryKeyId);
             }
         }
 
         if (ev.status == EventWriteStatus::Pending) {
-            ev.levId = env.insert_Event(txn, ev.receivedAt, ev.flatStr, (uint64_t)ev.sourceType, ev.sourceInfo);
+            PreparedIndexKeys::current = &keys;
+
+            try {
+                ev.levId = env.insert_Event(txn, ev.receivedAt, ev.flatStr, (uint64_t)ev.sourceType, ev.sourceInfo);
+            } catch (...) {
+                PreparedIndexKeys::current = nullptr;
+                throw;
+            }
+
+            PreparedIndexKeys::current = nullptr;
+
+            // levIds only increase, so the payload can always be appended
 
             tmpBuf.clear();
             tmpBuf += '\x00';
             tmpBuf += ev.jsonStr;
-            env.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(ev.levId), tmpBuf);
+            env.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(ev.levId), tmpBuf, MDB_APPEND);
+            EventCover::put(txn, ev.levId, flat, MDB_APPEND);
 
             ev.status = EventWriteStatus::Written;
+            statsDelta.add(flat, 1);
 
             // Deletions happen after event was written to ensure levIds are not reused
 
-            for (auto levId : levIdsToDelete) deleteEvent(txn, levId);
+            for (auto levId : levIdsToDelete) deleteEvent(txn, levId, &statsDelta);
             levIdsToDelete.clear();
         }
 
         if (levIdsToDelete.size()) throw herr("unprocessed deletion");
     }
+
+    statsDelta.apply(txn);
 }
@@ -5,6 +5,10 @@
 #include "golpe.h"
 
 #include "Decompressor.h"
+#include "EventParser.h"
+#include "XOnlyPubkeyCache.h"
+#include "IndexStats.h"
+#include "EventCover.h"
 
 
 
@@ -34,14 +38,33 @@ inline bool isEphemeralKind(uint64_t kind) {
 
 
 std::string nostrJsonToFlat(const tao::json::value &v);
+std::string nostrJsonToFlat(const EventParser &parsed);
+// These re-use output's existing capacity, and don't otherwise allocate after a thread's first few calls
+void nostrJsonToFlat(const tao::json::value &v, std::string &output);
+void nostrJsonToFlat(const EventParser &parsed, std::string &output);
+std::string nostrHashPreimage(const tao::json::value &origJson);
 std::string nostrHash(const tao::json::value &origJson);
 
-bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey);
-void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson);
+// The expensive parts of verifying an event, left for the caller to do later on many events at once (see EventBatchVerifier)
+struct DeferredEventChecks {
+    std::string hashPreimage; // sha256 of this must equal the event id
+    std::string sig; // decoded signature, must be valid for the event id and pubkey
+};
+
+bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey, XOnlyPubkeyCache *pubkeyCache = nullptr);
+void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson, DeferredEventChecks *deferred = nullptr);
 void verifyNostrEventJsonSize(std::string_view jsonStr);
 void verifyEventTimestamp(const NostrIndex::Event *flat);
 
-void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr);
+// If deferred is non-null, neither the event id nor the signature is checked. Instead, the values needed
+// to check them are stored in deferred
+void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr, DeferredEventChecks *deferred = nullptr);
+// Same output as above, for an event already parsed with EventParser::tryParse()
+void parseAndVerifyEvent(EventParser &parsed, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr, DeferredEventChecks *deferred = nullptr);
+
+
+// Can be called by any thread, see PreparedIndexKeys.h
+PreparedIndexKeys prepareIndexKeys(const NostrIndex::Event *flat);
 
 
 // Does not do verification!
@@ -98,6 +121,7 @@ struct EventToWrite {
     void *userData = nullptr;
     EventWriteStatus status = EventWriteStatus::Pending;
     uint64_t levId = 0;
+    std::optional<PreparedIndexKeys> prepared; // computed by writeEvents() if not supplied
 
     EventToWrite() {}
 
@@ -117,4 +141,5 @@ struct EventToWrite {
 
 
 void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLevel = 1);
-bool deleteEvent(lmdb::txn &txn, uint64_t levId);
+// If statsDelta is supplied, the change to IndexStats is added to it instead of being applied immediately
+bool deleteEvent(lmdb::txn &txn, uint64_t levId, IndexStatsDelta *statsDelta = nullptr);
@@ -2,6 +2,8 @@
 
 #include "golpe.h"
 
+#include "ScanContinuation.h"
+
 
 struct FilterSetBytes {
     struct Item {
@@ -12,6 +14,9 @@ struct FilterSetBytes {
 
     std::vector<Item> items;
     std::string buf;
+    flat_hash_set<uint64_t> fingerprints; // first 8 bytes of every item, for large sets where all items are at least that long
+
+    static const size_t FINGERPRINT_MIN_ITEMS = 32;
 
     // Sizes are post-hex decode 
 
@@ -36,6 +41,19 @@ struct FilterSetBytes {
         }
 
         if (buf.size() > 65535) throw herr("total filter items too large");
+
+        // Most candidates checked against large sets (such as a follow list's authors) don't match, and can be
+        // rejected with one hash lookup instead of a binary search over the items
+
+        if (items.size() >= FINGERPRINT_MIN_ITEMS && std::all_of(items.begin(), items.end(), [](const auto &item){ return item.size >= 8; })) {
+            for (const auto &item : items) fingerprints.insert(fingerprint(std::string_view(buf.data() + item.offset, item.size)));
+        }
+    }
+
+    static uint64_t fingerprint(std::string_view s) {
+        uint64_t output;
+        memcpy(&output, s.data(), sizeof(output));
+        return output;
     }
 
     std::string at(size_t n) const {
@@ -49,6 +67,8 @@ struct FilterSetBytes {
     }
 
     bool doesMatch(std::string_view candidate) const {
+        if (fingerprints.size() && (candidate.size() < 8 || !fingerprints.contains(fingerprint(candidate)))) return false;
+
         // Binary search for upper-bound: https://en.cppreference.com/w/cpp/algorithm/upper_bound
 
         ssize_t first = 0, last = items.size(), curr;
@@ -114,12 +134,15 @@ struct NostrFilter {
     uint64_t since = 0;
     uint64_t until = MAX_U64;
     uint64_t limit = MAX_U64;
+    bool ascending = false; // return the oldest matching events first. Non-standard, set with "order": "asc"
     bool neverMatch = false;
-    bool indexOnlyScans = false;
 
-    explicit NostrFilter(const tao::json::value &filterObj, uint64_t maxFilterLimit) {
-        uint64_t numMajorFields = 0;
+    // Non-standard "cursor" item: a token returned at EOSE to continue the scan from where it stopped (or an
+    // empty string for the first page). When present, a new token is returned at EOSE for the next page
+    bool wantsContinuation = false;
+    std::optional<ScanContinuation> continuation;
 
+    explicit NostrFilter(const tao::json::value &filterObj, uint64_t maxFilterLimit) {
         for (const auto &[k, v] : filterObj.get_object()) {
             if (v.is_array() && v.get_array().size() == 0) {
                 neverMatch = true;
@@ -128,15 +151,11 @@ struct NostrFilter {
 
             if (k == "ids") {
                 ids.emplace(v, true, 1, 32);
-                numMajorFields++;
             } else if (k == "authors") {
                 authors.emplace(v, true, 1, 32);
-                numMajorFields++;
             } else if (k == "kinds") {
                 kinds.emplace(v);
-                numMajorFields++;
             } else if (k.starts_with('#')) {
-                numMajorFields++;
                 if (k.size() == 2) {
                     char tag = k[1];
 
@@ -154,6 +173,12 @@ struct NostrFilter {
                 until = v.get_unsigned();
             } else if (k == "limit") {
                 limit = v.get_unsigned();
+            } else if (k == "cursor") {
+                wantsContinuation = true;
+                if (v.get_string().size()) continuation = ScanContinuation::decode(from_hex(v.get_string(), false));
+            } else if (k == "order") {
+                if (v.get_string() == "asc") ascending = true;
+                else if (v.get_string() != "desc") throw herr("unrecognised order");
             } else {
                 throw herr("unrecognised filter item");
             }
@@ -163,7 +188,68 @@ struct NostrFilter {
 
         if (limit > maxFilterLimit) limit = maxFilterLimit;
 
-        indexOnlyScans = (numMajorFields <= 1) || (numMajorFields == 2 && authors && kinds);
+        if (wantsContinuation) {
+            // Prefix scans don't visit events in order within each cursor, so their positions can't be recorded
+            auto hasPrefixes = [](const auto &fs){
+                for (size_t i = 0; i < fs.size(); i++) {
+                    if (fs.at(i).size() != 32) return true;
+                }
+                return false;
+            };
+
+            if ((ids && hasPrefixes(*ids)) || (authors && hasPrefixes(*authors))) throw herr("cursor can't be used with id/author prefixes");
+            if (continuation && continuation->filterHash != continuationHash()) throw herr("cursor is for a different filter");
+        }
+    }
+
+    // Normalised form of the filter: keys sorted, items sorted with duplicates and redundant prefixes removed,
+    // and limit clamped. Filters that match the same events have the same JSON
+
+    tao::json::value toJson() const {
+        tao::json::value output = tao::json::empty_object;
+
+        auto bytesToJson = [](const FilterSetBytes &fs, bool hexEncode){
+            tao::json::value arr = tao::json::empty_array;
+            for (size_t i = 0; i < fs.size(); i++) arr.push_back(hexEncode ? to_hex(fs.at(i)) : fs.at(i));
+            return arr;
+        };
+
+        if (ids) output["ids"] = bytesToJson(*ids, true);
+        if (authors) output["authors"] = bytesToJson(*authors, true);
+
+        if (kinds) {
+            tao::json::value arr = tao::json::empty_array;
+            for (size_t i = 0; i < kinds->size(); i++) arr.push_back(kinds->at(i));
+            output["kinds"] = std::move(arr);
+        }
+
+        for (const auto &[tag, filt] : tags) {
+            output[std::string("#") + tag] = bytesToJson(filt, tag == 'p' || tag == 'e');
+        }
+
+        if (since != 0) output["since"] = since;
+        if (until != MAX_U64) output["until"] = until;
+        if (limit != MAX_U64) output["limit"] = limit;
+        if (ascending) output["order"] = "asc";
+        if (wantsContinuation) output["cursor"] = continuation ? to_hex(continuation->encode()) : "";
+
+        return output;
+    }
+
+    // Identifies the filter in continuation tokens. The limit can change from page to page
+    uint64_t continuationHash() const {
+        auto json = toJson();
+        json.get_object().erase("cursor");
+        json.get_object().erase("limit");
+
+        uint64_t h = 14695981039346656037ULL; // FNV-1a
+
+        for (unsigned char c : tao::json::to_string(json)) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+
+        return h;
     }
 
     bool doesMatchTimes(uint64_t created) const {
@@ -248,7 +334,30 @@ struct NostrFilterGroup {
         return false;
     }
 
+    bool wantsContinuation() const {
+        for (const auto &f : filters) {
+            if (f.wantsContinuation) return true;
+        }
+
+        return false;
+    }
+
+    // Every filter only looks up events by id
+    bool isIdLookup() const {
+        for (const auto &f : filters) {
+            if (!f.ids) return false;
+        }
+
+        return true;
+    }
+
     size_t size() const {
         return filters.size();
     }
+
+    tao::json::value toJson() const {
+        tao::json::value output = tao::json::empty_array;
+        for (const auto &f : filters) output.push_back(f.toJson());
+        return output;
+    }
 };
@@ -5,6 +5,8 @@
 
 #include "golpe.h"
 
+#include "IndexStats.h"
+
 
 static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     auto dbTooOld = [&](uint64_t ver) {
@@ -37,6 +39,7 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
         }
 
         env.insert_Meta(txn, CURR_DB_VERSION, 1);
+        IndexStats::markComplete(txn); // new DB, so the (empty) stats cover every event
         return;
     }
 
@@ -50,6 +53,14 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     if (s->dbVersion() > CURR_DB_VERSION) {
         dbTooNew(s->dbVersion());
     }
+
+    if (cmd == "relay" && !IndexStats(txn).complete) {
+        LW << "Index stats have not been built, so queries will use a fixed index order. Run 'strfry stats --rebuild' to build them";
+    }
+
+    if (cmd == "relay" && env.dbi_EventCover.size(txn) < IndexStats(txn).total()) {
+        LW << "Some events have no cover values, so queries will load them to check kinds and authors. Run 'strfry stats --rebuild' to build them";
+    }
 }
 
 static void setRLimits() {
@@ -0,0 +1,37 @@
+// LD_PRELOAD shim for test/flatAllocTest.pl. Counts the malloc/calloc/realloc calls a thread makes while counting is
+// enabled, for `strfry bench flat --count-allocs`, which looks up these functions with dlsym(). glibc only.
+//
+//     cc -O2 -shared -fPIC -o allocCounter.so test/allocCounter.c
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static __thread int counting = 0;
+static uint64_t numAllocs = 0; // only incremented by threads that are counting
+
+void *malloc(size_t size) {
+    if (counting) __atomic_add_fetch(&numAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (counting) __atomic_add_fetch(&numAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    if (counting) __atomic_add_fetch(&numAllocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+void allocCounterEnable(int on) {
+    counting = on;
+}
+
+uint64_t allocCounterTotal(void) {
+    return __atomic_load_n(&numAllocs, __ATOMIC_RELAXED);
+}
@@ -208,6 +208,7 @@ sub genRandomMonitorCmds {
 
 sub testScan {
     my $fg = shift;
+    my $ascending = shift;
     my $fge = encode_json($fg);
 
     #print JSON::XS->new->pretty(1)->encode($fg);
@@ -215,8 +216,11 @@ sub testScan {
 
     my $headCmd = @$fg == 1 && $fg->[0]->{limit} ? "| head -n $fg->[0]->{limit}" : "";
 
-    my $resA = `./strfry export --reverse 2>/dev/null | perl test/dumbFilter.pl '$fge' $headCmd | jq -r .id | sort | sha256sum`;
-    my $resB = `./strfry scan --pause 1 --metrics '$fge' | jq -r .id | sort | sha256sum`;
+    my $exportFlags = $ascending ? "" : "--reverse";
+    my $scanFlags = $ascending ? "--ascending" : "";
+
+    my $resA = `./strfry export $exportFlags 2>/dev/null | perl test/dumbFilter.pl '$fge' $headCmd | jq -r .id | sort | sha256sum`;
+    my $resB = `./strfry scan --pause 1 --metrics $scanFlags '$fge' | jq -r .id | sort | sha256sum`;
 
     print "$resA\n$resB\n";
 
@@ -229,6 +233,57 @@ sub testScan {
 }
 
 
+# Pages through the filter's results with continuation tokens, and checks that the pages add up to the unpaged scan
+
+sub testPagedScan {
+    my $fg = shift;
+    my $ascending = shift;
+
+    my $f = $fg->[0];
+    $f->{limit} = 1 + int(rand() * 50);
+    $f->{order} = 'asc' if $ascending;
+
+    my %unpaged = %$f;
+    delete $unpaged{limit};
+    my $unpagedFe = encode_json(\%unpaged);
+
+    print "$unpagedFe (pages of $f->{limit})\n";
+
+    my @expected = sort map { decode_json($_)->{id} } `./strfry scan '$unpagedFe'`;
+
+    my @paged;
+    my $cursor = "";
+    my $numPages = 0;
+
+    while (defined $cursor) {
+        my $pageFe = encode_json({ %$f, cursor => $cursor });
+        my @lines = map { decode_json($_) } `./strfry scan --pause 1 '$pageFe'`;
+
+        my $eose = pop @lines;
+        die "no continuation token" if ref($eose) ne 'ARRAY' || $eose->[0] ne 'EOSE';
+
+        push @paged, map { $_->{id} } @lines;
+        $cursor = $eose->[1]->[0];
+
+        if (++$numPages > @expected + 1) {
+            print STDERR "$pageFe\n";
+            die "TOO MANY PAGES";
+        }
+    }
+
+    @paged = sort @paged;
+
+    print "$numPages pages, " . scalar(@paged) . " events, expected " . scalar(@expected) . "\n";
+
+    if (join(',', @paged) ne join(',', @expected)) {
+        print STDERR "$unpagedFe\n";
+        die "MISMATCH";
+    }
+
+    print "-----------MATCH OK-------------\n\n\n";
+}
+
+
 sub testMonitor {
     my $monCmds = shift;
     my $interestFg = shift;
@@ -276,6 +331,16 @@ if ($cmd eq 'scan') {
         my $fg = genRandomFilterGroup(1);
         testScan($fg);
     }
+} elsif ($cmd eq 'scan-ascending') {
+    while (1) {
+        my $fg = genRandomFilterGroup(1);
+        testScan($fg, 1);
+    }
+} elsif ($cmd eq 'scan-paged') {
+    while (1) {
+        my $fg = genRandomFilterGroup(1);
+        testPagedScan($fg, rand() < .5);
+    }
 } elsif ($cmd eq 'monitor') {
     while (1) {
         my ($monCmds, $interestFg) = genRandomMonitorCmds();
@@ -0,0 +1,62 @@
+#!/usr/bin/env perl
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+use JSON::XS;
+
+
+# Checks that converting events to flatbuffers does no heap allocation once the per-thread scratch
+# buffers have warmed up. Signatures are not verified, so the events only need to be well-formed.
+# Allocations are counted by test/allocCounter.c, which is preloaded into strfry only for this test.
+
+my $shim = "/tmp/strfry-allocCounter-$$.so";
+system("cc -O2 -shared -fPIC -o $shim test/allocCounter.c") == 0 || die "unable to build allocation counter shim";
+
+srand($ENV{SEED} || 0);
+
+sub randHex { join '', map { sprintf("%02x", int(rand(256))) } 1..$_[0] }
+
+my @events;
+
+sub addEvent {
+    my ($kind, $tags, $content) = @_;
+
+    push @events, encode_json({
+        id => randHex(32),
+        pubkey => randHex(32),
+        sig => randHex(64),
+        created_at => 1700000000 + int(rand(1000000)),
+        kind => $kind,
+        tags => $tags,
+        content => $content // "hello",
+    });
+}
+
+# Contact lists of various sizes, up to 2000 p tags
+addEvent(3, [ map { ["p", randHex(32), "wss://relay.example.com", "name$_"] } 1..$_ ]) for (1, 10, 500, 2000);
+
+# Replies, with e and p tags
+addEvent(1, [ ["e", randHex(32), "", "root"], ["e", randHex(32), "", "reply"], ["p", randHex(32)] ], "reply") for 1..50;
+
+# Hashtags and other single-letter tags, some too long to be indexed
+addEvent(1, [ ["t", "nostr"], ["t", "x" x 300], ["r", "https://example.com"], ["client", "test"] ]) for 1..20;
+
+# Replaceable, parameterised replaceable, ephemeral and expiring events
+addEvent(10002, [ ["r", "wss://relay.example.com"] ]);
+addEvent(30023, [ ["d", "article"], ["title", "t"] ], "long form " x 100);
+addEvent(20001, []);
+addEvent(1, [ ["expiration", "2000000000"] ]);
+
+open(my $fh, '|-', "LD_PRELOAD=$shim ./strfry --config test/strfry.conf bench flat --iterations=3 --count-allocs") || die "$!";
+print $fh "$_\n" for @events;
+close($fh);
+my $status = $?;
+
+unlink($shim);
+
+die "bench flat failed: allocations in steady state?" if $status;
+
+print "OK\n";
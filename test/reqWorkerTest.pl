@@ -0,0 +1,336 @@
+#!/usr/bin/env perl
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+use IPC::Open2;
+use JSON::XS;
+
+
+# Tests of how the ReqWorker's QueryScheduler runs subscriptions, using `strfry reqworker`.
+# Signatures are not verified, so the events only need to be well-formed.
+
+srand($ENV{SEED} || 0);
+
+sub randHex { join '', map { sprintf("%02x", int(rand(256))) } 1..$_[0] }
+
+my $numEvents = 5000; # enough that a {"kinds":[1]} scan takes several timeslices
+my $nextCreatedAt = 1700000000;
+
+sub genEvent {
+    my ($kind, $tags, $pubkey) = @_;
+
+    return {
+        id => randHex(32),
+        pubkey => $pubkey // randHex(32),
+        sig => randHex(64),
+        created_at => $nextCreatedAt++,
+        kind => $kind,
+        tags => $tags // [],
+        content => "hello",
+    };
+}
+
+sub cleanDb {
+    system("mkdir -p strfry-db-test");
+    system("rm -f strfry-db-test/data.mdb");
+}
+
+sub importEvents {
+    open(my $fh, '|-', './strfry --config test/strfry.conf import --no-verify 2>/dev/null') || die "$!";
+    print $fh encode_json($_), "\n" for @_;
+    close($fh);
+    die "import failed" if $?;
+}
+
+# Ids of the events a plain scan returns, in order
+sub scanIds {
+    my $filter = encode_json(shift);
+    my @ids = map { decode_json($_)->{id} } `./strfry --config test/strfry.conf scan '$filter'`;
+    die "scan failed" if $?;
+    return \@ids;
+}
+
+# Runs the commands through `strfry reqworker`, and returns what it printed
+sub runCmds {
+    my ($flags, $cmds) = @_;
+
+    my $pid = open2(my $outfile, my $infile, "./strfry --config test/strfry.conf reqworker $flags 2>/dev/null");
+    print $infile encode_json($_), "\n" for @$cmds;
+    close($infile);
+
+    my @output = map { decode_json($_) } <$outfile>;
+
+    waitpid($pid, 0);
+    die "reqworker cmd died" if $?;
+
+    return \@output;
+}
+
+# Starts `strfry reqworker` for commands to be sent to it one step at a time, so that events can be imported in between
+sub startReqWorker {
+    my $flags = shift;
+
+    my $pid = open2(my $outfile, my $infile, "./strfry --config test/strfry.conf reqworker $flags 2>/dev/null");
+    $infile->autoflush(1);
+
+    return { pid => $pid, in => $infile, out => $outfile };
+}
+
+sub sendCmds {
+    my ($rw, @cmds) = @_;
+    print { $rw->{in} } encode_json($_), "\n" for @cmds;
+}
+
+# Reads output up to and including the first line of the given type, connId and subId (if given)
+sub readUntil {
+    my ($rw, $type, $connId, $subId) = @_;
+    my @output;
+
+    while (1) {
+        my $line = readline($rw->{out});
+        die "reqworker output ended" if !defined $line;
+
+        my $o = decode_json($line);
+        push @output, $o;
+        return \@output if $o->[0] eq $type && (!defined $connId || ($o->[1] == $connId && $o->[2] eq $subId));
+    }
+}
+
+sub stopReqWorker {
+    my $rw = shift;
+
+    close($rw->{in});
+    my @rest = map { decode_json($_) } readline($rw->{out});
+
+    waitpid($rw->{pid}, 0);
+    die "reqworker cmd died" if $?;
+
+    return \@rest;
+}
+
+sub eventIds {
+    my ($output, $connId, $subId) = @_;
+    return [ map { $_->[3] } grep { $_->[0] eq 'EVENT' && $_->[1] == $connId && $_->[2] eq $subId } @$output ];
+}
+
+# Index of the first line of output matching type, connId and subId, or -1
+sub findLine {
+    my ($output, $type, $connId, $subId) = @_;
+
+    for my $i (0..$#$output) {
+        my $o = $output->[$i];
+        return $i if $o->[0] eq $type && $o->[1] == $connId && $o->[2] eq $subId;
+    }
+
+    return -1;
+}
+
+sub sameIds {
+    my ($x, $y) = @_;
+    return join(',', @$x) eq join(',', @$y);
+}
+
+sub doTest {
+    my $spec = shift;
+    print "* $spec->{desc}\n";
+    $spec->{test}->();
+}
+
+
+cleanDb();
+
+my $author = randHex(32);
+importEvents((map { genEvent(1) } 1..$numEvents), (map { genEvent(7, [], $author) } 1..20));
+
+my $filter = { kinds => [1] };
+my $expected = scanIds($filter);
+die "unexpected number of events" if @$expected != $numEvents;
+
+
+doTest({
+    desc => "Subscription joins a scan in progress, and is sent what was already found first",
+    test => sub {
+        my $output = runCmds("--share-scans", [
+            ["sub", 1, "a", $filter],
+            ["process"],
+            ["sub", 2, "b", $filter],
+            ["run"],
+        ]);
+
+        my $shared = findLine($output, "SHARED", 2, "b");
+        die "didn't join" if $shared == -1;
+
+        my @before = @$output[0..$shared-1];
+        my $caughtUp = eventIds(\@before, 2, "b");
+        die "nothing to catch up on" if !@$caughtUp;
+        die "scan finished before joining" if @$caughtUp == $numEvents;
+        die "catch-up differs from what was sent" if !sameIds($caughtUp, eventIds(\@before, 1, "a"));
+
+        die "original sub results incorrect" if !sameIds(eventIds($output, 1, "a"), $expected);
+        die "joined sub results incorrect" if !sameIds(eventIds($output, 2, "b"), $expected);
+        die "missing EOSE" if findLine($output, "EOSE", 1, "a") == -1 || findLine($output, "EOSE", 2, "b") == -1;
+    },
+});
+
+
+doTest({
+    desc => "Original subscriber is closed, and the scan continues for the one that joined",
+    test => sub {
+        my $output = runCmds("--share-scans", [
+            ["sub", 1, "a", $filter],
+            ["process"],
+            ["sub", 2, "b", $filter],
+            ["removeSub", 1, "a"],
+            ["run"],
+        ]);
+
+        my $shared = findLine($output, "SHARED", 2, "b");
+        die "didn't join" if $shared == -1;
+
+        my @before = @$output[0..$shared-1];
+        die "closed sub was sent events after it was closed" if !sameIds(eventIds($output, 1, "a"), eventIds(\@before, 1, "a"));
+        die "closed sub got EOSE" if findLine($output, "EOSE", 1, "a") != -1;
+
+        die "joined sub results incorrect" if !sameIds(eventIds($output, 2, "b"), $expected);
+        die "missing EOSE" if findLine($output, "EOSE", 2, "b") == -1;
+    },
+});
+
+
+doTest({
+    desc => "Scans are not shared unless enabled",
+    test => sub {
+        my $output = runCmds("", [
+            ["sub", 1, "a", $filter],
+            ["process"],
+            ["sub", 2, "b", $filter],
+            ["run"],
+        ]);
+
+        die "joined" if findLine($output, "SHARED", 2, "b") != -1;
+        die "sub results incorrect" if !sameIds(eventIds($output, 1, "a"), $expected) || !sameIds(eventIds($output, 2, "b"), $expected);
+    },
+});
+
+
+doTest({
+    desc => "Scans are not joined once events have been written since they began",
+    test => sub {
+        my $rw = startReqWorker("--share-scans");
+
+        sendCmds($rw, ["sub", 1, "a", $filter], ["process"]);
+        my $first = readUntil($rw, "EVENT"); # scan has started, with its txn
+
+        importEvents(genEvent(1));
+
+        sendCmds($rw, ["sub", 2, "b", $filter], ["run"]);
+        my @output = (@$first, @{ stopReqWorker($rw) });
+
+        die "joined" if findLine(\@output, "SHARED", 2, "b") != -1;
+        die "original sub results incorrect" if !sameIds(eventIds(\@output, 1, "a"), $expected);
+        die "new sub didn't get the new event" if @{ eventIds(\@output, 2, "b") } != $numEvents + 1;
+    },
+});
+
+
+doTest({
+    desc => "Subscription is closed while its query is running on another thread",
+    test => sub {
+        my $rw = startReqWorker("");
+
+        sendCmds($rw, ["sub", 1, "a", $filter], ["sub", 2, "b", $filter], ["away", 1, "a"], ["stats"]);
+        my $before = readUntil($rw, "STATS");
+
+        sendCmds($rw, ["removeSub", 1, "a"], ["runAway"], ["run"]);
+        my $after = stopReqWorker($rw);
+
+        die "closed sub was sent events" if @{ eventIds($after, 1, "a") };
+        die "closed sub got EOSE" if findLine($after, "EOSE", 1, "a") != -1;
+        die "other sub results incorrect" if !sameIds(eventIds([ @$before, @$after ], 2, "b"), scanIds($filter));
+        die "missing EOSE" if findLine($after, "EOSE", 2, "b") == -1;
+    },
+});
+
+
+doTest({
+    desc => "Subscription is replaced while its query is running on another thread",
+    test => sub {
+        my $rw = startReqWorker("");
+        my $newFilter = { kinds => [7] };
+
+        sendCmds($rw, ["sub", 1, "a", $filter], ["sub", 2, "b", $filter], ["away", 1, "a"], ["stats"]);
+        my $before = readUntil($rw, "STATS");
+
+        sendCmds($rw, ["sub", 1, "a", $newFilter], ["runAway"], ["run"]);
+        my $after = stopReqWorker($rw);
+
+        die "replaced sub was sent events from the old query" if !sameIds(eventIds($after, 1, "a"), scanIds($newFilter));
+        die "wrong number of EOSEs" if (grep { $_->[0] eq 'EOSE' && $_->[1] == 1 } @$after) != 1;
+        die "other sub results incorrect" if !sameIds(eventIds([ @$before, @$after ], 2, "b"), scanIds($filter));
+    },
+});
+
+
+doTest({
+    desc => "Result cache: hits, extensions, and invalidation by matching writes and deletions",
+    test => sub {
+        my $rw = startReqWorker("--cache-entries=100");
+
+        # Sends a REQ and waits for its EOSE. Returns the ids sent and the cache's counters
+        my $req = sub {
+            my ($connId, $f) = @_;
+
+            sendCmds($rw, ["sub", $connId, "s", $f], ["run"], ["stats"]);
+            my $output = readUntil($rw, "EOSE", $connId, "s");
+            my $stats = readUntil($rw, "STATS")->[-1]->[1];
+
+            return (eventIds($output, $connId, "s"), $stats);
+        };
+
+        my $filter7 = { kinds => [7] };
+
+        my ($ids, $stats) = $req->(1, $filter7);
+        die "first REQ incorrect" if !sameIds($ids, scanIds($filter7)) || @$ids != 20;
+        die "first REQ wasn't a miss" if $stats->{misses} != 1 || $stats->{hits} != 0 || $stats->{entries} != 1;
+
+        ($ids, $stats) = $req->(2, $filter7);
+        die "repeated REQ incorrect" if !sameIds($ids, scanIds($filter7));
+        die "repeated REQ wasn't a hit" if $stats->{hits} != 1 || $stats->{extensions} != 0;
+
+        # An event that doesn't match is written: the entry is still valid, and its watermark is advanced
+        importEvents(genEvent(9));
+
+        ($ids, $stats) = $req->(3, $filter7);
+        die "REQ after non-matching write incorrect" if !sameIds($ids, scanIds($filter7));
+        die "entry wasn't extended" if $stats->{hits} != 2 || $stats->{extensions} != 1;
+
+        # A matching event is written: the entry is discarded, and the REQ is scanned again
+        importEvents(genEvent(7, [], $author));
+
+        ($ids, $stats) = $req->(4, $filter7);
+        die "REQ after matching write incorrect" if !sameIds($ids, scanIds($filter7)) || @$ids != 21;
+        die "entry wasn't invalidated by matching write" if $stats->{invalidations} != 1 || $stats->{misses} != 2 || $stats->{entries} != 1;
+
+        # One of the cached events is deleted: the entry is discarded
+        importEvents(genEvent(5, [["e", $ids->[0]]], $author));
+
+        ($ids, $stats) = $req->(5, $filter7);
+        die "REQ after deletion incorrect" if !sameIds($ids, scanIds($filter7)) || @$ids != 20;
+        die "entry wasn't invalidated by deletion" if $stats->{invalidations} != 2 || $stats->{misses} != 3;
+
+        # Id lookups aren't cached
+        my $idFilter = { ids => [ $ids->[0] ] };
+        $req->(6, $idFilter);
+        ($ids, $stats) = $req->(7, $idFilter);
+        die "id lookup incorrect" if @$ids != 1;
+        die "id lookup was cached" if $stats->{entries} != 1 || $stats->{hits} != 2 || $stats->{misses} != 3;
+
+        stopReqWorker($rw);
+    },
+});
+
+
+print "OK\n";